@@ -0,0 +1,112 @@
+
+/* link benchmark: the payload is used as a data source, sink or loopback */
+
+enum {
+	BENCH_SOURCE = 1,
+	BENCH_SINK,
+	BENCH_LOOP
+};
+
+#define BENCH_MIN_BLK 64
+#define BENCH_LATENCY 500
+
+static double time_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Returns the time taken, the round trips are stored if lat isn't NULL.
+static double link_run(usbio_t *io, unsigned mode,
+		unsigned size, unsigned count, double *lat) {
+	uint32_t args[3], res[2], sum = 0;
+	uint8_t buf[PL_BLOCK_MAX];
+	unsigned i;
+	double t0, t1 = 0;
+	int retry, ret;
+
+	// the payload sends the low byte of the offset
+	for (i = 0; i < size; i++) buf[i] = mode == BENCH_SOURCE ? i : i * 0x9d + 1;
+	for (i = 0; i < size; i += 4) sum += READ32_LE(buf + i);
+	sum *= count;
+
+	args[0] = mode; args[1] = size; args[2] = count;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_LINK_BENCH);
+		pl_send(io, args, sizeof(args));
+		pl_recv(io, res, 4);
+		if (!io->err && res[0])
+			ERR_EXIT("link_bench failed (status %u)\n", res[0]);
+		t0 = time_now();
+		for (i = 0; i < count && !io->err; i++) {
+			if (lat) t1 = time_now();
+			if (mode != BENCH_SOURCE) usb_send(io, buf, size);
+			if (mode == BENCH_SINK) continue;
+			if (usb_recv(io, size) != (int)size)
+				IO_FAIL(io, "unexpected response\n");
+			else if (memcmp(io->buf, buf, size))
+				IO_FAIL(io, "link_bench: bad data\n");
+			if (lat) lat[i] = time_now() - t1;
+		}
+		pl_recv(io, res, sizeof(res));
+		t1 = time_now() - t0;
+		if (!io->err && mode != BENCH_SOURCE && res[1] != sum)
+			IO_FAIL(io, "link_bench: bad checksum\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0) ERR_EXIT("link_bench: too many errors\n");
+	return t1;
+}
+
+// Returns the MB/s for the block size, the loopback counts both ways.
+static double link_rate(usbio_t *io, unsigned mode, unsigned blk, uint32_t total) {
+	unsigned count = (total + blk - 1) / blk;
+	if (mode == BENCH_LOOP) count = (count + 1) / 2;
+	return (mode == BENCH_LOOP ? 2.0 : 1.0) * blk * count /
+			link_run(io, mode, blk, count, NULL) / 1e6;
+}
+
+// Measures the throughput for each block size, the round-trip latency
+// and optionally uses the best block sizes for the rest of the session.
+static void link_bench(usbio_t *io, uint32_t total, int tune) {
+	double up, down, loop, best_up = 0, best_down = 0;
+	double lat[BENCH_LATENCY];
+	unsigned blk, up_blk = PL_BLOCK_MAX, down_blk = PL_BLOCK_MAX;
+
+	if (!(pl_caps & PL_CAP_LINK_BENCH))
+		ERR_EXIT("link_bench: not supported by the payload\n");
+	if (!total) total = 1 << 20;
+
+	printf("link_bench: %u bytes per test\n", total);
+	printf("  block   up MB/s  down MB/s  loop MB/s\n");
+	for (blk = BENCH_MIN_BLK; blk <= PL_BLOCK_MAX; blk <<= 1) {
+		up = link_rate(io, BENCH_SOURCE, blk, total);
+		down = link_rate(io, BENCH_SINK, blk, total);
+		loop = link_rate(io, BENCH_LOOP, blk, total);
+		printf("  %5u  %8.3f  %9.3f  %9.3f\n", blk, up, down, loop);
+		if (up > best_up) best_up = up, up_blk = blk;
+		if (down > best_down) best_down = down, down_blk = blk;
+	}
+
+	link_run(io, BENCH_LOOP, 4, BENCH_LATENCY, lat);
+	qsort(lat, BENCH_LATENCY, sizeof(double), cmp_double);
+	printf("round trip (us): min %.0f, p50 %.0f, p90 %.0f, p99 %.0f, max %.0f\n",
+			lat[0] * 1e6, lat[BENCH_LATENCY / 2] * 1e6,
+			lat[BENCH_LATENCY * 9 / 10] * 1e6, lat[BENCH_LATENCY * 99 / 100] * 1e6,
+			lat[BENCH_LATENCY - 1] * 1e6);
+	printf("best block: up %u (%.3f MB/s), down %u (%.3f MB/s)\n",
+			up_blk, best_up, down_blk, best_down);
+
+	if (tune) {
+		chunk.pl_read = up_blk;
+		chunk.pl_write = down_blk;
+		if (io->verbose)
+			DBG_LOG("chunk: pl_read %u, pl_write %u\n", chunk.pl_read, chunk.pl_write);
+	}
+}
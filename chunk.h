@@ -0,0 +1,129 @@
+
+/* transfer sizes: set by hand or probed by timing reads with each size,
+   the BROM limits and the SFI buffer size aren't documented */
+
+#define CHUNK_PROBE_SIZE 0x8000
+// on-chip RAM, used by the BROM
+#define CHUNK_PROBE_ADDR 0x70000000
+
+// Returns the MB/s or a negative value if the size doesn't work.
+typedef double (*chunk_probe_fn)(usbio_t *io, unsigned size);
+
+static double chunk_probe_brom(usbio_t *io, unsigned size) {
+	uint8_t buf[TEMP_BUF_LEN];
+	uint32_t off;
+	double t = time_now();
+	for (off = 0; off < CHUNK_PROBE_SIZE && !io->err; off += size)
+		brom_read_cmd(io, CHUNK_PROBE_ADDR + off, size, CMD_READ32, buf);
+	return CHUNK_PROBE_SIZE / (time_now() - t) / 1e6;
+}
+
+// A larger step is accepted only if it reads the same data.
+static double chunk_probe_sfi(usbio_t *io, unsigned size) {
+	uint8_t ref[256], buf[256];
+	unsigned old = chunk.sfi_read, n = CHUNK_PROBE_SIZE / 8;
+	double t;
+
+	chunk.sfi_read = 128;
+	sfi_read(io, 0, ref, sizeof(ref));
+	chunk.sfi_read = size;
+	sfi_read(io, 0, buf, sizeof(buf));
+	if (size > 128 && (kern_fill(ref, sizeof(ref), ref[0]) == sizeof(ref) ||
+			memcmp(ref, buf, sizeof(buf)))) {
+		chunk.sfi_read = old;
+		return -1;
+	}
+	t = time_now();
+	for (; n && !io->err; n -= size)
+		sfi_read(io, 0, NULL, size);
+	t = time_now() - t;
+	chunk.sfi_read = old;
+	return CHUNK_PROBE_SIZE / 8 / t / 1e6;
+}
+
+static double chunk_probe_pl_read(usbio_t *io, unsigned size) {
+	return link_rate(io, BENCH_SOURCE, size, CHUNK_PROBE_SIZE);
+}
+
+static double chunk_probe_pl_write(usbio_t *io, unsigned size) {
+	return link_rate(io, BENCH_SINK, size, CHUNK_PROBE_SIZE);
+}
+
+// the probes try powers of two from lo to max
+static const struct {
+	const char *name;
+	unsigned *val, min, max, align, lo;
+	chunk_probe_fn probe;
+} chunk_table[] = {
+	{ "brom_read", &chunk.brom_read, 4, TEMP_BUF_LEN, 4, 256, chunk_probe_brom },
+	{ "sfi_read", &chunk.sfi_read, 1, 256, 1, 32, chunk_probe_sfi },
+	// the checksum of the upload is continued in 16-bit words
+	{ "upload", &chunk.upload, 2, 0x100000, 2, 0, NULL },
+	// power of two
+	{ "pl_read", &chunk.pl_read, 4, PL_BLOCK_MAX, 0, 64, chunk_probe_pl_read },
+	{ "pl_write", &chunk.pl_write, 1, PL_BLOCK_MAX, 1, 64, chunk_probe_pl_write },
+	{ NULL, NULL, 0, 0, 0, 0, NULL }
+};
+
+static int chunk_can_probe(unsigned *val) {
+	if (val == &chunk.brom_read) return 1;
+	if (val == &chunk.sfi_read) return pl_resident;
+	if (val == &chunk.pl_read || val == &chunk.pl_write)
+		return pl_caps & PL_CAP_LINK_BENCH;
+	return 0;
+}
+
+static unsigned chunk_tune(usbio_t *io, int i) {
+	unsigned size, best = 0;
+	double rate, best_rate = 0;
+	int fail;
+
+	for (size = chunk_table[i].lo; size <= chunk_table[i].max; size <<= 1) {
+		io->recover++;
+		io->err = 0;
+		rate = chunk_table[i].probe(io, size);
+		fail = io->err;
+		io->err = 0;
+		io->recover--;
+		if (fail) io_resync(io);
+		if (fail || rate < 0) break;
+		if (io->verbose)
+			DBG_LOG("chunk: %s %u, %.3f MB/s\n", chunk_table[i].name, size, rate);
+		if (rate > best_rate) best_rate = rate, best = size;
+	}
+	if (!best) ERR_EXIT("chunk: %s probe failed\n", chunk_table[i].name);
+	return best;
+}
+
+// Sets a transfer size, zero size probes it ("all" probes what the session supports).
+static void chunk_cmd(usbio_t *io, const char *name, uint64_t size) {
+	int i, all = !strcmp(name, "all");
+	unsigned *val;
+
+	if (all && size) ERR_EXIT("chunk: all needs auto\n");
+	for (i = 0; chunk_table[i].name; i++) {
+		if (!all && strcmp(name, chunk_table[i].name)) continue;
+		val = chunk_table[i].val;
+		if (!size) {
+			if (!chunk_table[i].probe || !chunk_can_probe(val)) {
+				if (all) continue;
+				ERR_EXIT("chunk: %s can't be probed\n", name);
+			}
+			*val = chunk_tune(io, i);
+		} else {
+			if (size < chunk_table[i].min || size > chunk_table[i].max ||
+					(chunk_table[i].align ? size % chunk_table[i].align :
+					size & (size - 1)))
+				ERR_EXIT("chunk: bad size for %s\n", name);
+			*val = size;
+		}
+		// whole packets, except for the last one
+		if (val == &chunk.upload && io->packet_out > 0 &&
+				*val > (unsigned)io->packet_out)
+			*val -= *val % io->packet_out;
+		if (io->verbose)
+			DBG_LOG("chunk: %s = %u\n", chunk_table[i].name, *val);
+		if (!all) return;
+	}
+	if (!all) ERR_EXIT("chunk: unknown name \"%s\"\n", name);
+}
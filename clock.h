@@ -0,0 +1,123 @@
+
+/* clock profiles: register ops from a table file, run by the payload,
+   the old values of the written registers are restored before reboot */
+
+// the table starts each profile with "profile <chip> <name>",
+// followed by register ops as in "regs" scripts
+#define CLOCK_MAX 64
+#define CLOCK_TEST_SIZE 0x10000
+
+static struct {
+	uint32_t addr[CLOCK_MAX], val[CLOCK_MAX];
+	uint8_t wide[CLOCK_MAX];
+	unsigned n;
+} clock_saved;
+
+static int clock_saved_find(uint32_t addr) {
+	unsigned i;
+	for (i = 0; i < clock_saved.n; i++)
+		if (clock_saved.addr[i] == addr) return 1;
+	return 0;
+}
+
+// Reads the registers the profile writes, keeps the values from before the first profile.
+static void clock_save(usbio_t *io, regs_t *prof) {
+	uint32_t *ops = prof->ops, res[CLOCK_MAX], a, i, k, n = clock_saved.n;
+	unsigned op;
+	regs_t r;
+
+	regs_init(&r);
+	for (i = 0; i < prof->n; i += 1 + regs_nargs[op]) {
+		op = ops[i]; a = ops[i + 1];
+		if (op != REGS_W32 && op != REGS_W16 && op != REGS_SET && op != REGS_CLR)
+			continue;
+		if (clock_saved_find(a)) continue;
+		if (clock_saved.n == CLOCK_MAX) ERR_EXIT("clock: too many registers\n");
+		clock_saved.addr[clock_saved.n] = a;
+		clock_saved.wide[clock_saved.n++] = op != REGS_W16;
+		regs_op(&r, op != REGS_W16 ? REGS_R32 : REGS_R16, a, 0, 0, 0);
+	}
+	regs_run(io, &r, res);
+	for (k = 0; n + k < clock_saved.n; k++)
+		clock_saved.val[n + k] = res[k];
+}
+
+// The registers are written back in the reverse order.
+static void clock_restore(usbio_t *io) {
+	regs_t r;
+	unsigned i;
+
+	if (!clock_saved.n) return;
+	regs_init(&r);
+	for (i = clock_saved.n; i--; )
+		regs_op(&r, clock_saved.wide[i] ? REGS_W32 : REGS_W16,
+				clock_saved.addr[i], clock_saved.val[i], 0, 0);
+	regs_run(io, &r, NULL);
+	if (io->verbose) DBG_LOG("clock: %u registers restored\n", clock_saved.n);
+	clock_saved.n = 0;
+}
+
+static void clock_load(regs_t *r, const char *fn, uint32_t chip, const char *name) {
+	char line[256], pname[64];
+	uint32_t args[4];
+	unsigned op, line_num = 0, pchip;
+	int sel = 0, found = 0;
+	FILE *f = fopen(fn, "r");
+
+	if (!f) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	regs_init(r);
+	while (fgets(line, sizeof(line), f)) {
+		line_num++;
+		if (sscanf(line, " profile %x %63s", &pchip, pname) == 2) {
+			sel = pchip == chip && !strcmp(pname, name);
+			found |= sel;
+			continue;
+		}
+		if (!(op = regs_parse(line, args, fn, line_num)) || !sel) continue;
+		regs_op(r, op, args[0], args[1], args[2], args[3]);
+	}
+	fclose(f);
+	if (!found)
+		ERR_EXIT("clock: no profile \"%s\" for chip %04x in \"%s\"\n", name, chip, fn);
+}
+
+// The first 64K of the flash, read by the payload (checksums) or SFI,
+// returns the time taken.
+static double clock_test(usbio_t *io, uint32_t *crc) {
+	static uint8_t buf[CLOCK_TEST_SIZE];
+	double t = time_now();
+	if (pl_caps & PL_CAP_READ_HASH)
+		pl_hash(io, 0, CLOCK_TEST_SIZE, crc);
+	else {
+		sfi_read(io, 0, buf, CLOCK_TEST_SIZE);
+		crc[0] = crc32(0, buf, CLOCK_TEST_SIZE);
+	}
+	return time_now() - t;
+}
+
+// Runs the profile, the old clocks are restored if the flash reads
+// back different data after the change.
+static void clock_set(usbio_t *io, const char *fn, uint32_t chip, const char *name) {
+	uint32_t res[REGS_MAX], ref[CLOCK_TEST_SIZE / FCACHE_BLK], crc[CLOCK_TEST_SIZE / FCACHE_BLK];
+	double t0, t1;
+	regs_t r;
+	int status;
+
+	if (chip != 0x6260 && chip != 0x6261)
+		ERR_EXIT("clock: unsupported chip\n");
+	clock_load(&r, fn, chip, name);
+	t0 = clock_test(io, ref);
+	clock_save(io, &r);
+	status = regs_run(io, &r, res);
+	if (io->verbose) regs_print(&r, res, status);
+	if (!status) {
+		t1 = clock_test(io, crc);
+		if (!memcmp(ref, crc, (pl_caps & PL_CAP_READ_HASH ? CLOCK_TEST_SIZE / FCACHE_BLK : 1) * 4)) {
+			DBG_LOG("clock: %s, read-back ok, %.3f -> %.3f MB/s\n", name,
+					CLOCK_TEST_SIZE / t0 / 1e6, CLOCK_TEST_SIZE / t1 / 1e6);
+			return;
+		}
+	}
+	clock_restore(io);
+	ERR_EXIT("clock: %s, %s, restored\n", name, status ? "poll timeout" : "read-back failed");
+}
@@ -0,0 +1,81 @@
+
+/* flash copy and fill done by the payload, one erase block per command,
+   only the status and a checksum are sent back */
+
+#define FILL_MAX 64
+
+// Returns the crc32 of the new data continued from crc.
+static uint32_t pl_flash_copy(usbio_t *io, uint32_t addr, uint32_t size,
+		uint32_t src, const uint8_t *pat, unsigned len, uint32_t crc, unsigned *erased) {
+	uint32_t args[7], res[3 + FTIME_NUM];
+	unsigned nres = pl_caps & PL_CAP_FLASH_TIME ? 3 + FTIME_NUM : 3;
+	int retry, ret;
+
+	args[0] = addr; args[1] = size;
+	args[2] = erase_cmd; args[3] = erase_blk;
+	args[4] = src; args[5] = len; args[6] = crc;
+	flash_written++;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_FLASH_COPY);
+		pl_send(io, args, sizeof(args));
+		pl_send(io, pat, FILL_MAX);
+		pl_recv(io, res, nres * 4);
+		// the source isn't changed, so it's safe to repeat
+		if (!io->err && res[0] == FLASH_BAD_CHECKSUM)
+			IO_FAIL(io, "flash copy: bad checksum\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0)
+		ERR_EXIT("flash copy failed at 0x%08x (too many errors)\n", addr);
+	if (res[0])
+		ERR_EXIT("flash copy failed at 0x%08x (status %u)\n", addr, res[0]);
+	if (nres > 3) ftime_add(addr & -erase_blk, res[1], res + 3);
+	*erased += res[1];
+	return res[2];
+}
+
+// Copies from src, or fills with the pattern if len isn't zero
+// (src is then the offset in the pattern).
+static void flash_copy(usbio_t *io, uint32_t addr, uint32_t size,
+		uint32_t src, const uint8_t *pat, unsigned len) {
+	static const uint8_t none[FILL_MAX];
+	uint8_t buf[PL_BLOCK_MAX];
+	uint32_t n, i, off, crc = 0, expect = 0;
+	unsigned erased = 0;
+	const char *what = len ? "fill_flash" : "copy_flash";
+
+	if (!(pl_caps & PL_CAP_FLASH_COPY))
+		ERR_EXIT("%s: not supported by the payload\n", what);
+	if ((uint64_t)addr + size > 1ull << 32 || (!len && (uint64_t)src + size > 1ull << 32))
+		ERR_EXIT("32-bit limit reached\n");
+	// the blocks are done in order, a block can't overwrite the rest of the source
+	if (!len && addr > src && addr < (uint64_t)src + size)
+		ERR_EXIT("copy_flash: the ranges overlap\n");
+	if (!len) pat = none;
+
+	for (off = 0; off < size; off += n) {
+		n = erase_blk - ((addr + off) & (erase_blk - 1));
+		if (n > size - off) n = size - off;
+		crc = pl_flash_copy(io, addr + off, n,
+				len ? (src + off) % len : src + off, pat, len, crc, &erased);
+		if (len) {
+			for (i = 0; i < n; i++) buf[i] = pat[(src + off + i) % len];
+			expect = crc32(expect, buf, n);
+			if (crc != expect)
+				ERR_EXIT("fill_flash: bad checksum at 0x%08x\n", addr + off);
+		}
+	}
+	fcache_drop(addr, size);
+	fcache_save();
+	DBG_LOG("%s: 0x%08x, size: 0x%x, erased: %u, crc32: 0x%08x\n",
+			what, addr, size, erased, crc);
+}
+
+static void fill_flash(usbio_t *io, uint32_t addr, uint32_t size, const char *str) {
+	uint8_t pat[SEARCH_MAX * 2];
+	unsigned len = search_parse(str, pat, pat + SEARCH_MAX), i;
+	for (i = 0; i < len; i++)
+		if (pat[SEARCH_MAX + i] != 0xff) ERR_EXIT("fill_flash: bad pattern\n");
+	flash_copy(io, addr, size, 0, pat, len);
+}
@@ -1,33 +1,132 @@
 
+// commands implemented in the payload
+enum {
+	CMD_CUSTOM_SFI         = 0x55,
+	CMD_FLASH_WRITE        = 0x56,
+	CMD_READ_BLOCK         = 0x57,
+	CMD_MEM_WRITE          = 0x58,
+	CMD_REGS               = 0x59,
+	CMD_PROBE              = 0x5a,
+	CMD_LINK_BENCH         = 0x5b,
+	CMD_SEARCH             = 0x5c,
+	CMD_FLASH_COPY         = 0x5d
+};
+
+enum {
+	PL_CAP_FLASH_WRITE = 1,
+	PL_CAP_READ_BLOCK = 2,
+	PL_CAP_MEM_WRITE = 4,
+	PL_CAP_REGS = 8,
+	PL_CAP_READ_HASH = 16,
+	PL_CAP_LINK_BENCH = 32,
+	PL_CAP_SEARCH = 64,
+	PL_CAP_FLASH_COPY = 128,
+	PL_CAP_FLASH_TIME = 256,
+	// the args of the commands with data are acked before it's sent
+	PL_CAP_ARGS_ACK = 512
+};
+
+// Set by a successful probe, or by --caps for a payload that can't be
+// probed. Without PL_CAP_MEM_WRITE and PL_CAP_REGS the BROM commands are used.
+static unsigned pl_caps = 0;
+
+#define PL_MAGIC 0x4c50544d // "MTPL"
+
+// magic, version, caps of the running payload
+static uint32_t pl_info[3];
+static int pl_resident = 0;
+
+#define PL_BLOCK_MAX 0x1000
+
 static unsigned spd_checksum(const void *src, int len) {
-	uint16_t *s = (uint16_t*)src;
-	uint32_t crc = 0;
-	for (; len >= 2; len -= 2) crc += *s++;
+	uint32_t crc = kern_sum16((const uint8_t*)src, len >> 1);
 	crc = (crc >> 16) + (crc & 0xffff);
 	crc += crc >> 16;
 	return ~crc & 0xffff;
 }
 
+/* checksummed packets for the payload commands */
+static void pl_send(usbio_t *io, const void *data, unsigned len) {
+	uint8_t buf[PL_BLOCK_MAX + 4];
+	if (len > PL_BLOCK_MAX)
+		ERR_EXIT("unexpected size\n");
+	memcpy(buf, data, len);
+	if (len & 1) buf[len++] = 0;
+	*(uint16_t*)&buf[len] = spd_checksum(buf, len);
+	usb_send(io, buf, len + 2);
+}
+
+static void pl_recv(usbio_t *io, void *data, unsigned len) {
+	unsigned len2 = (len + 3) & ~1;
+	if (usb_recv(io, len2) != (int)len2)
+		IO_FAIL(io, "unexpected response\n");
+	else if (spd_checksum(io->buf, len2))
+		IO_FAIL(io, "bad checksum\n");
+	if (io->err) memset(data, 0, len);
+	else memcpy(data, io->buf, len);
+}
+
+// Checks for a running payload, sets pl_caps and the HW/SW info if found.
+static int pl_probe(usbio_t *io, int timeout, uint32_t *info) {
+	uint32_t res[7];
+	int old = io->timeout;
+
+	io->timeout = timeout;
+	io->recover++;
+	mtk_echo8(io, CMD_PROBE);
+	pl_recv(io, res, sizeof(res));
+	pl_resident = !io->err && res[0] == PL_MAGIC;
+	io->err = 0;
+	io->recover--;
+	if (!pl_resident) io_drain(io, 50);
+	io->timeout = old;
+	if (!pl_resident) return 0;
+
+	memcpy(pl_info, res, sizeof(pl_info));
+	pl_caps = res[2];
+	if (info) memcpy(info, res + 3, 4 * 4);
+	if (io->verbose)
+		DBG_LOG("payload: version %u, caps 0x%x\n", res[1], res[2]);
+	return 1;
+}
+
+// Finds the probe info stored in a payload binary.
+static int pl_find_info(const uint8_t *mem, size_t size, uint32_t *info) {
+	size_t i; int k;
+	for (i = 0; i + 12 <= size; i += 4)
+		if ((uint32_t)READ32_LE(mem + i) == PL_MAGIC) {
+			for (k = 0; k < 3; k++) info[k] = READ32_LE(mem + i + k * 4);
+			return 1;
+		}
+	return 0;
+}
+
 static void sfi_cmd(usbio_t *io, int qpi, uint8_t *msg, unsigned mlen, unsigned rlen) {
 	uint16_t *data = (uint16_t*)io->buf;
 	uint8_t *buf = (uint8_t*)io->buf + 4;
-	int rlen2;
+	int rlen2, retry, ret;
+	unsigned n;
 
 	if (mlen + rlen > 256 + 6)
 		ERR_EXIT("unexpected size\n");
-	mtk_echo8(io, 0x55);
-	memmove(buf, msg, mlen);
-	data[0] = mlen | qpi << 15;
-	data[1] = rlen;
-	if (mlen & 1) buf[mlen++] = 0;
-	*(uint16_t*)&buf[mlen] = spd_checksum(data, 4 + mlen);
-	usb_send(io, NULL, 4 + mlen + 2);
-
 	rlen2 = (rlen + 3) & ~1;
-	if (usb_recv(io, rlen2) != rlen2)
-		ERR_EXIT("unexpected response\n");
-	if (spd_checksum(io->buf, rlen2))
-		ERR_EXIT("bad checksum\n");
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_CUSTOM_SFI);
+		memmove(buf, msg, n = mlen);
+		data[0] = mlen | qpi << 15;
+		data[1] = rlen;
+		if (n & 1) buf[n++] = 0;
+		*(uint16_t*)&buf[n] = spd_checksum(data, 4 + n);
+		usb_send(io, NULL, 4 + n + 2);
+
+		if (usb_recv(io, rlen2) != rlen2)
+			IO_FAIL(io, "unexpected response\n");
+		else if (spd_checksum(io->buf, rlen2))
+			IO_FAIL(io, "bad checksum\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0) ERR_EXIT("too many errors\n");
 }
 
 static void sfi_cmd_addr(usbio_t *io, unsigned cmd,
@@ -59,6 +158,20 @@ static void sfi_read_sfdp(usbio_t *io, uint32_t addr, void *buf, unsigned size)
 	}
 }
 
+// The density from the basic parameter table in bytes, or 0.
+static uint64_t sfdp_density(const uint8_t *sfdp) {
+	unsigned i = sfdp[12] | sfdp[13] << 8 | sfdp[14] << 16;
+	uint32_t x;
+	if (memcmp(sfdp, "SFDP", 4) || i - 0x18 > 256 - 0x20) return 0;
+	x = READ32_LE(sfdp + i + 4);
+	if (x >> 31) {
+		x &= 0x7fffffff;
+		return x >= 3 && x < 64 + 3 ? (uint64_t)1 << (x - 3) : 0;
+	}
+	if (~x & 0x1fff) return 0;
+	return ((uint64_t)x + 1) >> 3;
+}
+
 static void sfi_read(usbio_t *io, uint32_t addr, void *buf, unsigned size) {
 	uint8_t *dst = (uint8_t*)buf, *end = dst + size;
 	unsigned n;
@@ -66,7 +179,7 @@ static void sfi_read(usbio_t *io, uint32_t addr, void *buf, unsigned size) {
 	while ((n = end - dst)) {
 		unsigned cmd = 0x03, k = 3;
 		if (addr >> 24) cmd = 0x13, k++;
-		if (n > 128) n = 128; // max = 0x90 - k - 1 ?
+		if (n > chunk.sfi_read) n = chunk.sfi_read;
 		sfi_cmd_addr(io, cmd, addr, k, n);
 		if (!dst) break;
 		memcpy(dst, io->buf, n);
@@ -77,15 +190,19 @@ static void sfi_read(usbio_t *io, uint32_t addr, void *buf, unsigned size) {
 static void sfi_write_enable(usbio_t *io) {
 	uint8_t msg[] = { 0x06 }; // Write Enable
 	sfi_cmd(io, 0, msg, 1, 0);
-	while (!(sfi_read_status(io) & 2));
+	while (!(sfi_read_status(io) & 2) && !io->err);
 }
 
 #define SFI_WRITE_WAIT \
 	usleep(30); \
 	/* wait for completion */ \
-	while (sfi_read_status(io) & 1);
+	while (sfi_read_status(io) & 1 && !io->err);
+
+// counts the writes, the mapped window may be stale after a write
+static int flash_written = 0;
 
 static void sfi_erase(usbio_t *io, uint32_t addr, int cmd, int addr_len) {
+	flash_written++;
 	sfi_write_enable(io);
 	// DBG_LOG("sfi_erase 0x%x, 0x%x\n", addr, cmd);
 	sfi_cmd_addr(io, cmd, addr, addr_len, 0);
@@ -97,6 +214,7 @@ static void sfi_write(usbio_t *io, uint32_t addr, const void *buf, unsigned size
 	const uint8_t *src = (const uint8_t*)buf, *end = src + size;
 	unsigned n, k;
 
+	flash_written++;
 	// DBG_LOG("sfi_write 0x%x, 0x%x\n", addr, size);
 	msg[0] = 0x02; // Page Program
 	while ((n = end - src)) {
@@ -125,9 +243,9 @@ static void sfi_write_cmp(usbio_t *io, uint32_t addr, const uint8_t *orig, const
 		k = 256 - (addr & 255);
 		if (n > k) n = k;
 		if (orig) {
-			for (i = 0; i < n && orig[i] == src[i]; i++);
+			i = kern_eq(orig, src, n);
 			orig += i;
-		} else for (i = 0; i < n && 0xff == src[i]; i++);
+		} else i = kern_fill(src, n, 0xff);
 		n -= i; addr += i; src += i;
 		if (n > 128) n = 128;
 		if (orig) {
@@ -139,50 +257,199 @@ static void sfi_write_cmp(usbio_t *io, uint32_t addr, const uint8_t *orig, const
 	}
 }
 
-static unsigned dump_flash(usbio_t *io,
-		uint32_t start, uint32_t len, const char *fn) {
-	uint32_t n, off, step = 128;
-	FILE *fo;
+// Expands the run-length coding used by the payload, returns the size or -1.
+static int rle_unpack(const uint8_t *src, unsigned n, uint8_t *dst, unsigned size) {
+	const uint8_t *end = src + n;
+	unsigned a, j = 0;
+	while (src < end) {
+		a = *src++;
+		if (a < 0x80) {
+			a++;
+			if (a > (unsigned)(end - src) || a > size - j) return -1;
+			memcpy(dst + j, src, a);
+			src += a;
+		} else {
+			a -= 0x80 - 3;
+			if (src >= end || a > size - j) return -1;
+			memset(dst + j, *src++, a);
+		}
+		j += a;
+	}
+	return j;
+}
 
-	fo = fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(dump) failed\n");
+// payload status codes
+enum {
+	FLASH_OK = 0,
+	FLASH_BAD_CHECKSUM = 1,
+	FLASH_BAD_ARGS = 2,
+	FLASH_BAD_DATA = 3,
+	FLASH_VERIFY_FAILED = 4,
+	FLASH_TIMEOUT = 5
+};
 
-	for (off = start; off < start + len; off += n) {
-		n = start + len - off;
-		if (n > step) n = step;
-		sfi_read(io, off, NULL, n);
+enum {
+	READ_FLASH = 1,
+	READ_PACK = 2,
+	READ_HASH = 4
+};
 
-		if (fwrite(io->buf, 1, n, fo) != n)
-			ERR_EXIT("fwrite(dump) failed\n");
+// log2 of the block size, 0 = PL_BLOCK_MAX (ignored by older payloads)
+#define READ_BLK_SHIFT 8
+
+static int pl_compress = 1;
+
+// a failed chunk is read again as a whole
+#define PL_READ_CHUNK 0x10000
+
+static int pl_read_chunk(usbio_t *io, uint32_t addr, uint32_t size,
+		unsigned flags, uint8_t *buf, uint64_t *recv_bytes) {
+	uint32_t args[3], hdr[3], res, off, n, packed;
+	uint8_t pack[PL_BLOCK_MAX];
+
+	args[0] = addr; args[1] = size; args[2] = flags;
+	if (chunk.pl_read != PL_BLOCK_MAX) {
+		for (n = 2; 1u << n < chunk.pl_read; n++);
+		args[2] |= n << READ_BLK_SHIFT;
+	}
+	mtk_echo8(io, CMD_READ_BLOCK);
+	pl_send(io, args, sizeof(args));
+	pl_recv(io, &res, sizeof(res));
+	if (io->err) return 0;
+	if (res)
+		ERR_EXIT("read failed (status %u)\n", res);
+
+	for (off = 0; off < size; off += n) {
+		pl_recv(io, hdr, sizeof(hdr));
+		if (io->err) return 0;
+		n = hdr[0]; packed = hdr[1];
+		if (!n || n > PL_BLOCK_MAX || n > size - off || packed >= n) {
+			IO_FAIL(io, "unexpected response\n");
+			return 0;
+		}
+		if (packed) {
+			pl_recv(io, pack, packed);
+			if (io->err) return 0;
+			if (rle_unpack(pack, packed, buf + off, n) != (int)n) {
+				IO_FAIL(io, "bad packed data at 0x%08x\n", addr + off);
+				return 0;
+			}
+		} else pl_recv(io, buf + off, n);
+		if (io->err) return 0;
+		*recv_bytes += packed ? packed : n;
+		if (crc32(0, buf + off, n) != hdr[2]) {
+			IO_FAIL(io, "bad block checksum at 0x%08x\n", addr + off);
+			return 0;
+		}
+		if (flags & READ_FLASH && n == FCACHE_BLK)
+			fcache_set(addr + off, hdr[2]);
 	}
-	DBG_LOG("dump_flash: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, off - start);
-	fclose(fo);
+	return 1;
+}
+
+// Reads memory or flash with the payload, returns the number of bytes read.
+static uint32_t pl_read(usbio_t *io,
+		uint32_t addr, uint32_t size, unsigned flags, dumpout_t *fo) {
+	uint32_t off, n;
+	uint8_t *buf;
+	uint64_t recv_bytes = 0;
+	int retry, ret = 0;
+
+	if (pl_compress) flags |= READ_PACK;
+	buf = (uint8_t*)malloc(PL_READ_CHUNK);
+	if (!buf) ERR_EXIT("malloc failed\n");
+	for (off = 0; off < size; off += n) {
+		n = size - off;
+		if (n > PL_READ_CHUNK) n = PL_READ_CHUNK;
+		for (retry = 0;; retry++) {
+			io_begin(io);
+			pl_read_chunk(io, addr + off, n, flags, buf, &recv_bytes);
+			if ((ret = io_end(io, retry)) <= 0) break;
+		}
+		if (ret < 0) {
+			DBG_LOG("read failed at 0x%08x\n", addr + off);
+			break;
+		}
+		dumpout_write(fo, buf, n);
+	}
+	free(buf);
+	if (io->verbose)
+		DBG_LOG("read: 0x%x bytes, received 0x%llx\n",
+				off, (unsigned long long)recv_bytes);
 	return off;
 }
 
+#define PL_HASH_CHUNK 0x100000
+
+// Gets the crc32 of each 4K block of the flash range, without the data.
+static void pl_hash(usbio_t *io, uint32_t addr, uint32_t size, uint32_t *crc) {
+	uint32_t args[3], hdr[3], res, off, i;
+	int retry, ret;
+
+	// the blocks of a chunk are requested again after an error
+	if (size > PL_HASH_CHUNK) {
+		for (off = 0; off < size; off += i) {
+			i = size - off;
+			if (i > PL_HASH_CHUNK) i = PL_HASH_CHUNK;
+			pl_hash(io, addr + off, i, crc + off / FCACHE_BLK);
+		}
+		return;
+	}
+	args[0] = addr; args[1] = size; args[2] = READ_FLASH | READ_HASH;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_READ_BLOCK);
+		pl_send(io, args, sizeof(args));
+		pl_recv(io, &res, sizeof(res));
+		if (!io->err && res)
+			ERR_EXIT("hash failed (status %u)\n", res);
+		for (off = i = 0; off < size && !io->err; off += hdr[0]) {
+			pl_recv(io, hdr, sizeof(hdr));
+			if (io->err) break;
+			if (!hdr[0] || hdr[0] > PL_BLOCK_MAX || hdr[0] > size - off || hdr[1])
+				IO_FAIL(io, "unexpected response\n");
+			else crc[i++] = hdr[2];
+		}
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0) ERR_EXIT("hash: too many errors\n");
+}
+
+static uint32_t blank_crc(void) {
+	static uint32_t crc;
+	uint8_t buf[FCACHE_BLK];
+	if (!crc) {
+		memset(buf, 0xff, sizeof(buf));
+		crc = crc32(0, buf, sizeof(buf));
+	}
+	return crc;
+}
+
 static unsigned erase_cmd = 0x20, erase_blk = 0x1000;
 
 static void erase_flash(usbio_t *io,
 		uint32_t addr, uint32_t size) {
-	uint32_t end = addr + size;
+	uint32_t end = addr + size, i;
 
 	if ((addr | size) & (erase_blk - 1))
 		ERR_EXIT("unaligned erase\n");
 
-	for (; addr < end; addr += erase_blk)
+	for (; addr < end; addr += erase_blk) {
 		sfi_erase(io, addr, erase_cmd, 3);
+		if (erase_blk < FCACHE_BLK) fcache_drop(addr, erase_blk);
+		else for (i = 0; i < erase_blk; i += FCACHE_BLK)
+			fcache_set(addr + i, blank_crc());
+	}
+	fcache_save();
 }
 
 // Check if erase is required (0 to 1 bits found).
 static int flash_cmp(const uint8_t *s, const uint8_t *d, unsigned n) {
-	unsigned i;
-	for (i = 0; i < n; i++)
-		if (~s[i] & d[i]) return 1;
-	return 0;
+	return kern_need_erase(s, d, n);
 }
 
-static void write_flash_buf(usbio_t *io,
-		const uint8_t *mem, uint32_t size, uint32_t addr) {
+static void write_flash_sfi(usbio_t *io, const uint8_t *mem,
+		uint32_t size, uint32_t addr, journal_t *j) {
 	uint32_t n, k, l, blk = erase_blk;
 	uint32_t end = addr + size;
 
@@ -221,15 +488,225 @@ static void write_flash_buf(usbio_t *io,
 		} else {
 			sfi_write_cmp(io, addr, buf + (addr & (blk - 1)), mem, n);
 		}
+		if (j) journal_add(j, n, BLK_DATA, -1);
 	}
 }
 
+static uint64_t flash_raw_bytes, flash_sent_bytes;
+
+// The data is LZ4 compressed if packed is not zero.
+// Returns 1 if the block was erased.
+static int pl_flash_send(usbio_t *io, uint32_t addr,
+		const uint8_t *src, unsigned size, unsigned packed) {
+	uint32_t args[5], res[2 + FTIME_NUM];
+	unsigned nres = pl_caps & PL_CAP_FLASH_TIME ? 2 + FTIME_NUM : 2;
+	int retry, ret;
+
+	args[0] = addr; args[1] = size; args[2] = packed;
+	args[3] = erase_cmd; args[4] = erase_blk;
+	flash_written++;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_FLASH_WRITE);
+		pl_send(io, args, sizeof(args));
+		res[0] = FLASH_OK;
+		if (pl_caps & PL_CAP_ARGS_ACK) pl_recv(io, res, 4);
+		if (!io->err && !res[0]) {
+			pl_send(io, src, packed ? packed : size);
+			pl_recv(io, res, nres * 4);
+		}
+		// the block is rewritten as a whole, so it's safe to repeat
+		if (!io->err && res[0] == FLASH_BAD_CHECKSUM)
+			IO_FAIL(io, "flash write: bad checksum\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0)
+		ERR_EXIT("flash write failed at 0x%08x (too many errors)\n", addr);
+	if (res[0])
+		ERR_EXIT("flash write failed at 0x%08x (status %u)\n", addr, res[0]);
+	if (nres > 2) ftime_add(addr & -erase_blk, res[1], res + 2);
+	flash_raw_bytes += size;
+	flash_sent_bytes += packed ? packed : size;
+	return res[1];
+}
+
+static int pl_flash_write(usbio_t *io,
+		uint32_t addr, const uint8_t *src, unsigned size) {
+	uint8_t pack[PL_BLOCK_MAX];
+	unsigned packed = lz4_compress(src, size, pack, size - 1);
+	return pl_flash_send(io, addr, packed ? pack : src, size, packed);
+}
+
+// Checks a few cached sectors of the range with the device, then drops
+// the ones that will be changed. The checksums of the new sectors are
+// computed from mem, or taken from crcs (little-endian, from a plan).
+// Returns 1 if the cache can be used.
+static int fcache_begin(usbio_t *io, const uint8_t *mem,
+		const uint8_t *crcs, uint32_t size, uint32_t addr) {
+	uint32_t a, crc, dev, k = 0, known = 0, step;
+	uint32_t first = addr & -FCACHE_BLK, end = addr + size;
+
+	if (!fcache.fn) return 0;
+	if (!(pl_caps & PL_CAP_READ_HASH)) {
+		fcache_drop(addr, size);
+		fcache_save();
+		return 0;
+	}
+	for (a = first; a < end; a += FCACHE_BLK)
+		known += fcache_get(a, &crc);
+	step = known / FCACHE_SPOT + 1;
+	for (a = first; a < end; a += FCACHE_BLK) {
+		if (!fcache_get(a, &crc) || k++ % step) continue;
+		pl_hash(io, a, FCACHE_BLK, &dev);
+		if (dev != crc) {
+			DBG_LOG("flash cache: mismatch at 0x%08x, cleared\n", a);
+			fcache_drop(0, ~0u);
+			break;
+		}
+	}
+	for (a = first; a < end; a += FCACHE_BLK)
+		if (a < addr || a + FCACHE_BLK > end || !fcache_get(a, &crc) ||
+				crc != (crcs ? (uint32_t)READ32_LE(crcs + (a - addr) / FCACHE_BLK * 4) :
+				crc32(0, mem + (a - addr), FCACHE_BLK)))
+			fcache_drop(a, FCACHE_BLK);
+	fcache_save();
+	return 1;
+}
+
+// The payload decompresses, erases and programs each block by itself.
+static void write_flash_pack(usbio_t *io, const uint8_t *mem,
+		uint32_t size, uint32_t addr, journal_t *j) {
+	uint32_t n, k, blk = erase_blk, erased = 0, skipped = 0, crc;
+	uint32_t end = addr + size;
+	int cache;
+
+	if (blk > PL_BLOCK_MAX)
+		ERR_EXIT("unsupported erase block size\n");
+
+	cache = fcache_begin(io, mem, NULL, size, addr);
+	flash_raw_bytes = flash_sent_bytes = 0;
+	for (; addr < end; mem += n, addr += n) {
+		k = (addr & -blk) + blk;
+		if (k > end) k = end;
+		n = k - addr;
+		// the sectors left in the cache are already written
+		if (cache && n == FCACHE_BLK && fcache_get(addr, &crc))
+			skipped++;
+		else {
+			erased += pl_flash_write(io, addr, mem, n);
+			if (n == FCACHE_BLK) fcache_set(addr, crc32(0, mem, n));
+		}
+		if (j) journal_add(j, n, BLK_DATA, -1);
+	}
+	fcache_save();
+	if (io->verbose)
+		DBG_LOG("write_flash: erased %u blocks, skipped %u, sent 0x%llx of 0x%llx bytes\n",
+				erased, skipped, (unsigned long long)flash_sent_bytes,
+				(unsigned long long)flash_raw_bytes);
+}
+
+static void write_flash_buf(usbio_t *io, const uint8_t *mem,
+		uint32_t size, uint32_t addr, journal_t *j) {
+	if (pl_caps & PL_CAP_FLASH_WRITE)
+		write_flash_pack(io, mem, size, addr, j);
+	else {
+		fcache_drop(addr, size);
+		fcache_save();
+		write_flash_sfi(io, mem, size, addr, j);
+	}
+}
+
+static unsigned dump_mem_pl(usbio_t *io,
+		uint32_t start, uint32_t len, const char *fn) {
+	uint32_t off;
+	dumpout_t *fo;
+
+	if ((len | start) & 3)
+		ERR_EXIT("unaligned read\n");
+
+	fo = dumpout_open(fn, "read_mem", start, len);
+	off = start + fo->pos;
+	off += pl_read(io, off, start + len - off, 0, fo);
+	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, off - start);
+	dumpout_close(fo);
+	return off;
+}
+
+// Returns the block checksums from <fn>.manifest if it matches the image.
+static uint32_t* manifest_check(const char *fn, const uint8_t *mem, size_t size) {
+	char *mfn = sidecar_name(fn, ".manifest");
+	uint32_t msize, nblk, *crc;
+	uint8_t sha[32], sha2[32];
+	sha256_t ctx;
+
+	crc = manifest_load(mfn, &msize, &nblk, sha);
+	free(mfn);
+	if (!crc) return NULL;
+	sha256_init(&ctx);
+	sha256_update(&ctx, mem, size);
+	sha256_final(&ctx, sha2);
+	if (msize != size || memcmp(sha, sha2, 32)) {
+		DBG_LOG("manifest: doesn't match the image, ignored\n");
+		free(crc);
+		return NULL;
+	}
+	return crc;
+}
+
+// Writes only the blocks whose checksums on the device differ,
+// the last block is compared only if it's the end of the image.
+static void write_flash_diff(usbio_t *io, const uint8_t *mem, const uint32_t *crc,
+		uint32_t size, uint32_t addr, int last, journal_t *j) {
+	uint32_t *dev, i, n, pos, start = 0, same = 0;
+	int diff;
+
+	dev = (uint32_t*)malloc((size / MANIFEST_BLK + 1) * 4);
+	if (!dev) ERR_EXIT("malloc failed\n");
+	pl_hash(io, addr, size, dev);
+	for (pos = 0, i = 0; ; pos += n, i++) {
+		n = size - pos;
+		if (n > MANIFEST_BLK) n = MANIFEST_BLK;
+		diff = n && (dev[i] != crc[i] || (n < MANIFEST_BLK && !last));
+		if (diff) continue;
+		if (start < pos)
+			write_flash_buf(io, mem + start, pos - start, addr + start, j);
+		if (!n) break;
+		if (j) journal_add(j, n, BLK_DATA, -1);
+		start = pos + n;
+		same++;
+	}
+	free(dev);
+	DBG_LOG("write_flash: %u of %u blocks already match\n", same, i);
+}
+
+// The write journal is kept only with --resume, next to the flash cache
+// of the device: <dir>/<meid>-<jedec>-<addr>.journal. The header has
+// the range and the checksum of id (the data or its block checksums).
+static journal_t* write_journal_open(uint32_t addr, uint32_t src_offs,
+		uint32_t size, const uint8_t *id, size_t id_len) {
+	char hdr[128], *fn;
+	journal_t *j;
+	int n;
+
+	if (!dump_resume) return NULL;
+	if (!fcache.fn)
+		ERR_EXIT("write_flash: --resume needs flash_cache (the journal is per device)\n");
+	n = strlen(fcache.fn) - 4;
+	fn = (char*)malloc(n + 16);
+	if (!fn) ERR_EXIT("malloc failed\n");
+	sprintf(fn, "%.*s-%08x", n, fcache.fn, addr);
+	snprintf(hdr, sizeof(hdr), "# mtk_dump journal write_flash 0x%08x 0x%x 0x%x 0x%08x\n",
+			addr, src_offs, size, crc32(0, id, id_len));
+	j = journal_open(fn, hdr, 1, NULL);
+	free(fn);
+	return j;
+}
+
 static void write_flash(usbio_t *io, const char *fn,
 		unsigned src_offs, uint32_t src_size, uint32_t addr) {
-	uint8_t *mem; size_t size = 0;
-	mem = loadfile(fn, &size);
-	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-	if (size >> 32) ERR_EXIT("file too big\n");
+	upload_file_t *f = upload_load(fn, UPLOAD_UNPACK);
+	const uint8_t *mem = f->mem; size_t size = f->size;
+	journal_t *j; uint32_t done, *crc;
 	if (size < src_offs)
 		ERR_EXIT("data outside the file\n");
 	size -= src_offs;
@@ -238,7 +715,129 @@ static void write_flash(usbio_t *io, const char *fn,
 			ERR_EXIT("data outside the file\n");
 		size = src_size;
 	}
-	write_flash_buf(io, mem + src_offs, size, addr);
-	free(mem);
+	j = write_journal_open(addr, src_offs, size, mem + src_offs, size);
+	done = !j ? 0 : j->done < size ? j->done : size;
+	crc = manifest_check(fn, f->mem, f->size);
+	if (crc && !((src_offs | addr | done) & (MANIFEST_BLK - 1)) &&
+			pl_caps & PL_CAP_READ_HASH)
+		write_flash_diff(io, mem + src_offs + done, crc + (src_offs + done) / MANIFEST_BLK,
+				size - done, addr + done, src_offs + size == f->size, j);
+	else
+		write_flash_buf(io, mem + src_offs + done, size - done, addr + done, j);
+	free(crc);
+	if (j) journal_close(j, 1);
 }
 
+// Compares the flash with a dump manifest.
+static void verify_flash(usbio_t *io, uint32_t addr, const char *fn) {
+	uint32_t size, nblk, *crc, *dev, i, start = 0, bad = 0;
+	uint8_t sha[32];
+
+	if (!(crc = manifest_load(fn, &size, &nblk, sha)))
+		ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	if (!(pl_caps & PL_CAP_READ_HASH))
+		ERR_EXIT("verify: the payload doesn't support hashing\n");
+	if (addr & (MANIFEST_BLK - 1))
+		ERR_EXIT("unaligned verify\n");
+	dev = (uint32_t*)malloc(nblk * 4 + 4);
+	if (!dev) ERR_EXIT("malloc failed\n");
+	pl_hash(io, addr, size, dev);
+	// the ranges of differing blocks
+	for (i = 0; i <= nblk; i++) {
+		if (i < nblk && dev[i] != crc[i]) {
+			if (!bad++ || dev[i - 1] == crc[i - 1]) start = i;
+			continue;
+		}
+		if (i && dev[i - 1] != crc[i - 1])
+			DBG_LOG("verify: 0x%08x-0x%08x differs\n", addr + start * MANIFEST_BLK,
+					addr + (i * MANIFEST_BLK < size ? i * MANIFEST_BLK : size) - 1);
+	}
+	DBG_LOG("verify: %u of %u blocks differ\n", bad, nblk);
+	free(dev); free(crc);
+}
+
+static void pl_mem_write(usbio_t *io,
+		uint32_t addr, const uint8_t *src, unsigned size) {
+	uint32_t args[3], res[2];
+	uint8_t pack[PL_BLOCK_MAX];
+	unsigned packed;
+	int retry, ret;
+
+	packed = lz4_compress(src, size, pack, size - 1);
+	args[0] = addr; args[1] = size; args[2] = packed;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_MEM_WRITE);
+		pl_send(io, args, sizeof(args));
+		res[0] = FLASH_OK;
+		if (pl_caps & PL_CAP_ARGS_ACK) pl_recv(io, res, 4);
+		if (!io->err && !res[0]) {
+			pl_send(io, packed ? pack : src, packed ? packed : size);
+			pl_recv(io, res, sizeof(res));
+		}
+		if (!io->err && res[0] == FLASH_BAD_CHECKSUM)
+			IO_FAIL(io, "write_mem: bad checksum\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0)
+		ERR_EXIT("write_mem failed at 0x%08x (too many errors)\n", addr);
+	if (res[0])
+		ERR_EXIT("write_mem failed at 0x%08x (status %u)\n", addr, res[0]);
+	if (res[1] != crc32(0, src, size))
+		ERR_EXIT("write_mem: verify failed at 0x%08x\n", addr);
+}
+
+#define WRITE_MEM_STEP 0x10000
+
+// 16-bit words without the echo, the odd byte at the end is merged.
+static void write_mem_brom(usbio_t *io,
+		uint32_t addr, const uint8_t *mem, uint32_t size) {
+	uint32_t off, n, k, i, j;
+	int retry, ret = 0;
+
+	if (addr & 1) ERR_EXIT("unaligned write\n");
+	for (off = 0; off < (size & ~1); off += n) {
+		n = (size & ~1) - off;
+		if (n > WRITE_MEM_STEP) n = WRITE_MEM_STEP;
+		for (retry = 0;; retry++) {
+			io_begin(io);
+			mtk_echo8(io, CMD_WRITE16_NO_ECHO);
+			mtk_echo32(io, addr + off);
+			mtk_echo32(io, n >> 1);
+			mtk_status(io);
+			for (k = 0; k < n && !io->err; k += i) {
+				const uint8_t *src = mem + off + k;
+				i = n - k;
+				if (i > TEMP_BUF_LEN) i = TEMP_BUF_LEN;
+				// sent as big-endian words
+				for (j = 0; j < i; j += 2) {
+					io->buf[j] = src[j + 1];
+					io->buf[j + 1] = src[j];
+				}
+				usb_send(io, NULL, i);
+			}
+			mtk_status(io);
+			if ((ret = io_end(io, retry)) <= 0) break;
+		}
+		if (ret < 0)
+			ERR_EXIT("write_mem failed at 0x%08x (too many errors)\n", addr + off);
+	}
+	if (size & 1) {
+		uint32_t a = addr + size - 1;
+		mtk_write16(io, a, (mtk_read16(io, a) & 0xff00) | mem[size - 1]);
+	}
+}
+
+static void write_mem(usbio_t *io, uint32_t addr, const char *fn) {
+	upload_file_t *f = upload_load(fn, UPLOAD_UNPACK);
+	const uint8_t *mem = f->mem; size_t size = f->size;
+	uint32_t off, n;
+	if (pl_caps & PL_CAP_MEM_WRITE) {
+		for (off = 0; off < size; off += n) {
+			n = size - off;
+			if (n > chunk.pl_write) n = chunk.pl_write;
+			pl_mem_write(io, addr + off, mem + off, n);
+		}
+	} else write_mem_brom(io, addr, mem, size);
+	DBG_LOG("write_mem: 0x%08x, size: 0x%x\n", addr, (unsigned)size);
+}
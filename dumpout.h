@@ -0,0 +1,299 @@
+
+/* dump output: sparse files, block maps and progress journals,
+   written by a separate thread so a slow disk doesn't stall the device */
+
+#define DUMP_BLK RING_BLK
+#define DUMP_RING 64
+
+enum { BLK_DATA, BLK_BLANK, BLK_FILL };
+static const char * const blk_names[] = { "data", "blank", "fill" };
+
+static int dump_sparse = 0, dump_blockmap = 0, dump_resume = 0, dump_manifest = 0;
+
+typedef struct {
+	FILE *f;
+	char *fn;
+	uint64_t done;
+} journal_t;
+
+typedef struct dumpout {
+	FILE *f, *map;
+	journal_t *journal;
+	manifest_t *manifest;
+	ring_t *ring;
+	uint32_t addr, size;
+	// pos is updated by the writer, next by the reader
+	uint64_t pos, next;
+	// the size of the resumed file, the old data there must be overwritten
+	uint64_t stale;
+	int hole, pipe;
+	// the current run of the block map
+	uint64_t run_pos, run_len;
+	int run_type, run_val;
+	// a fan-out passes the data on to the dumps inside its range
+	struct dumpout **fan;
+	unsigned nfan;
+} dumpout_t;
+
+static int blk_class(const uint8_t *p, unsigned n, int *val) {
+	unsigned a = p[0];
+	if (kern_fill(p, n, a) < n) return BLK_DATA;
+	if (a == 0xff) return BLK_BLANK;
+	*val = a;
+	return BLK_FILL;
+}
+
+static char* sidecar_name(const char *fn, const char *ext) {
+	char *s = (char*)malloc(strlen(fn) + strlen(ext) + 1);
+	if (!s) ERR_EXIT("malloc failed\n");
+	return strcat(strcpy(s, fn), ext);
+}
+
+static void dumpout_map_flush(dumpout_t *out) {
+	if (!out->map || out->run_type < 0) return;
+	fprintf(out->map, "0x%08llx 0x%08llx %s",
+			(unsigned long long)out->run_pos,
+			(unsigned long long)out->run_len, blk_names[out->run_type]);
+	if (out->run_type == BLK_FILL)
+		fprintf(out->map, " 0x%02x", out->run_val);
+	fprintf(out->map, "\n");
+}
+
+static void dumpout_map_add(dumpout_t *out, int type, int val, uint32_t n) {
+	if (type != out->run_type || val != out->run_val) {
+		dumpout_map_flush(out);
+		out->run_type = type; out->run_val = val;
+		out->run_pos = out->pos; out->run_len = 0;
+	}
+	out->run_len += n;
+	out->pos += n;
+}
+
+// The journal records the completed blocks of a job, one per line.
+// If resume is set and the header matches, the contiguous part
+// of the previous run is kept (and replayed to the block map).
+static journal_t* journal_open(const char *fn, const char *hdr,
+		int resume, dumpout_t *out) {
+	journal_t *j = (journal_t*)calloc(1, sizeof(journal_t));
+	char line[256], name[16], *keep = NULL;
+	size_t keep_len = 0;
+	FILE *f;
+
+	if (!j) ERR_EXIT("malloc failed\n");
+	j->fn = sidecar_name(fn, ".journal");
+	if (resume && (f = fopen(j->fn, "r"))) {
+		if (fgets(line, sizeof(line), f) && !strcmp(line, hdr))
+		while (fgets(line, sizeof(line), f)) {
+			unsigned long long pos, len; unsigned val = 0;
+			size_t n = strlen(line); int type;
+			if (sscanf(line, "%llx %llx %15s %x", &pos, &len, name, &val) < 3 ||
+					pos != j->done || !n || line[n - 1] != '\n') break;
+			for (type = 0; type < 3; type++)
+				if (!strcmp(name, blk_names[type])) break;
+			if (type == 3) break;
+			if (out) dumpout_map_add(out, type, type == BLK_FILL ? (int)val : -1, len);
+			if (out && out->manifest)
+				manifest_replay(out->manifest, out->f, j->done, len,
+						type == BLK_DATA ? -1 : type == BLK_BLANK ? 0xff : (int)val);
+			j->done += len;
+			keep = (char*)realloc(keep, keep_len + n + 1);
+			if (!keep) ERR_EXIT("malloc failed\n");
+			memcpy(keep + keep_len, line, n + 1);
+			keep_len += n;
+		}
+		fclose(f);
+		if (j->done)
+			DBG_LOG("resume: 0x%llx bytes already done\n", (unsigned long long)j->done);
+	}
+	// rewritten to drop a partial last line
+	j->f = fopen(j->fn, "w");
+	if (!j->f) ERR_EXIT("fopen(\"%s\") failed\n", j->fn);
+	fputs(hdr, j->f);
+	if (keep) fputs(keep, j->f);
+	fflush(j->f);
+	free(keep);
+	return j;
+}
+
+static void journal_add(journal_t *j, uint32_t n, int type, int val) {
+	fprintf(j->f, "0x%08llx 0x%x %s", (unsigned long long)j->done, n, blk_names[type]);
+	if (type == BLK_FILL) fprintf(j->f, " 0x%02x", val);
+	fprintf(j->f, "\n");
+	fflush(j->f);
+	j->done += n;
+}
+
+static void journal_close(journal_t *j, int complete) {
+	fclose(j->f);
+	if (complete) remove(j->fn);
+	else DBG_LOG("incomplete, progress saved to \"%s\" (use --resume)\n", j->fn);
+	free(j->fn);
+	free(j);
+}
+
+// Runs in the writer thread.
+static void dumpout_block(void *ctx, const uint8_t *buf, uint32_t n) {
+	dumpout_t *out = (dumpout_t*)ctx;
+	int val = -1, type;
+
+	type = blk_class(buf, n, &val);
+	if (dump_sparse && !out->pipe && out->pos >= out->stale &&
+			((type == BLK_FILL && !val) || (type == BLK_BLANK && out->map))) {
+		// holes are read as zeros, blank blocks are restored from the map
+		if (fseek(out->f, n, SEEK_CUR))
+			ERR_EXIT("fseek(dump) failed\n");
+		out->hole = 1;
+	} else {
+		if (fwrite(buf, 1, n, out->f) != n)
+			ERR_EXIT("fwrite(dump) failed\n");
+		out->hole = 0;
+	}
+	if (out->manifest) manifest_feed(out->manifest, buf, n);
+	if (out->journal) {
+		// the data is passed to the OS before it's journaled
+		// (not synced, so it may still be lost on a power failure)
+		fflush(out->f);
+		journal_add(out->journal, n, type, val);
+	}
+	dumpout_map_add(out, type, val, n);
+}
+
+static dumpout_t* dumpout_open(const char *fn, const char *what,
+		uint32_t addr, uint32_t size) {
+	dumpout_t *out = (dumpout_t*)calloc(1, sizeof(dumpout_t));
+	char hdr[128]; int resume;
+	if (!out) ERR_EXIT("malloc failed\n");
+	out->addr = addr;
+	out->size = size;
+	out->run_type = -1;
+	// "-" is stdout, without the sidecar files
+	if (!strcmp(fn, "-")) {
+		out->f = stdout;
+		out->pipe = 1;
+		out->ring = ring_open(DUMP_RING, dumpout_block, out);
+		return out;
+	}
+	out->f = dump_resume ? fopen(fn, "r+b") : NULL;
+	resume = out->f != NULL;
+	if (resume) {
+		struct stat st;
+		if (fstat(fileno(out->f), &st))
+			ERR_EXIT("fstat(dump) failed\n");
+		out->stale = st.st_size;
+	}
+	if (!out->f) out->f = fopen(fn, "wb");
+	if (!out->f) ERR_EXIT("fopen(dump) failed\n");
+	if (dump_blockmap) {
+		char *mapfn = sidecar_name(fn, ".map");
+		out->map = fopen(mapfn, "w");
+		if (!out->map) ERR_EXIT("fopen(\"%s\") failed\n", mapfn);
+		free(mapfn);
+		fprintf(out->map, "# mtk_dump block map\n"
+				"# addr 0x%08x size 0x%x block 0x%x\n", addr, size, DUMP_BLK);
+	}
+	if (dump_manifest)
+		out->manifest = manifest_open(sidecar_name(fn, ".manifest"), addr, size);
+	// the journal is kept only if it can be used
+	if (dump_resume) {
+		snprintf(hdr, sizeof(hdr), "# mtk_dump journal %s 0x%08x 0x%x\n", what, addr, size);
+		out->journal = journal_open(fn, hdr, resume, out);
+	}
+	if (out->pos) {
+		if (fseek(out->f, out->pos, SEEK_SET))
+			ERR_EXIT("fseek(dump) failed\n");
+		// the old file may be longer
+		out->hole = 1;
+	}
+	out->next = out->pos;
+	out->ring = ring_open(DUMP_RING, dumpout_block, out);
+	return out;
+}
+
+static void dumpout_append(dumpout_t *out, const uint8_t *buf, uint32_t len) {
+	ring_write(out->ring, buf, len);
+	out->next += len;
+}
+
+static void dumpout_fan_write(dumpout_t *out, const uint8_t *buf, uint32_t len) {
+	uint64_t a = out->addr + out->pos, next, end;
+	unsigned i;
+	for (i = 0; i < out->nfan; i++) {
+		dumpout_t *c = out->fan[i];
+		next = c->addr + c->next;
+		end = (uint64_t)c->addr + c->size;
+		if (end > a + len) end = a + len;
+		// the part before the resume point is skipped
+		if (next < a || next >= end) continue;
+		dumpout_append(c, buf + (next - a), end - next);
+	}
+	out->pos += len;
+}
+
+static void dumpout_write(dumpout_t *out, const uint8_t *buf, uint32_t len) {
+	if (out->fan) dumpout_fan_write(out, buf, len);
+	else dumpout_append(out, buf, len);
+}
+
+// The data of one read starting at addr is written to several dumps.
+static dumpout_t* dumpout_fan(dumpout_t **fan, unsigned n, uint32_t addr) {
+	dumpout_t *out = (dumpout_t*)calloc(1, sizeof(dumpout_t));
+	if (!out) ERR_EXIT("malloc failed\n");
+	out->fan = fan;
+	out->nfan = n;
+	out->addr = addr;
+	return out;
+}
+
+static void dumpout_close(dumpout_t *out) {
+	unsigned i;
+	if (out->fan) {
+		for (i = 0; i < out->nfan; i++) dumpout_close(out->fan[i]);
+		free(out);
+		return;
+	}
+	ring_close(out->ring);
+	if (out->pipe) {
+		fflush(out->f);
+		if (out->pos != out->size) DBG_LOG("incomplete\n");
+		free(out);
+		return;
+	}
+	if (out->hole) {
+		// extend the file if it ends with a hole
+		fflush(out->f);
+		if (ftruncate(fileno(out->f), out->pos))
+			ERR_EXIT("ftruncate(dump) failed\n");
+	}
+	fclose(out->f);
+	if (out->map) {
+		dumpout_map_flush(out);
+		fclose(out->map);
+	}
+	if (out->manifest) manifest_close(out->manifest, out->pos == out->size);
+	if (out->journal) journal_close(out->journal, out->pos == out->size);
+	else if (out->pos != out->size) DBG_LOG("incomplete\n");
+	free(out);
+}
+
+// Restores the blank and fill ranges of a sparse dump from its block map.
+static void blockmap_apply(const char *fn, uint8_t *mem, size_t size) {
+	char *mapfn = sidecar_name(fn, ".map"), line[256], name[16];
+	unsigned long long pos, len; unsigned val;
+	FILE *f = fopen(mapfn, "r");
+	free(mapfn);
+	if (!f) return;
+	while (fgets(line, sizeof(line), f)) {
+		int n, type;
+		if (line[0] == '#') continue;
+		val = 0;
+		n = sscanf(line, "%llx %llx %15s %x", &pos, &len, name, &val);
+		if (n < 3) ERR_EXIT("bad block map line: %s", line);
+		for (type = 0; type < 3; type++)
+			if (!strcmp(name, blk_names[type])) break;
+		if (type == 3) ERR_EXIT("bad block map line: %s", line);
+		if (type == BLK_DATA || pos >= size) continue;
+		if (len > size - pos) len = size - pos;
+		memset(mem + pos, type == BLK_BLANK ? 0xff : val, len);
+	}
+	fclose(f);
+}
@@ -0,0 +1,81 @@
+
+/* per-device cache of flash sector checksums, keyed by MEID and JEDEC ID */
+
+#define FCACHE_BLK 0x1000
+#define FCACHE_SPOT 8
+
+static struct {
+	char *fn;
+	uint32_t *crc, n;
+	uint8_t *known;
+	int dirty;
+} fcache;
+
+static int fcache_get(uint32_t addr, uint32_t *crc) {
+	uint32_t i = addr / FCACHE_BLK;
+	if (!fcache.fn || i >= fcache.n || !fcache.known[i]) return 0;
+	*crc = fcache.crc[i];
+	return 1;
+}
+
+static void fcache_set(uint32_t addr, uint32_t crc) {
+	uint32_t i = addr / FCACHE_BLK, n;
+	if (!fcache.fn) return;
+	if (i >= fcache.n) {
+		n = i + 1 + fcache.n / 2;
+		fcache.crc = (uint32_t*)realloc(fcache.crc, n * sizeof(uint32_t));
+		fcache.known = (uint8_t*)realloc(fcache.known, n);
+		if (!fcache.crc || !fcache.known) ERR_EXIT("malloc failed\n");
+		memset(fcache.known + fcache.n, 0, n - fcache.n);
+		fcache.n = n;
+	}
+	fcache.crc[i] = crc;
+	fcache.known[i] = 1;
+	fcache.dirty = 1;
+}
+
+// Forgets the sectors overlapping the range.
+static void fcache_drop(uint32_t addr, uint32_t size) {
+	uint64_t i = addr / FCACHE_BLK;
+	uint64_t end = ((uint64_t)addr + size + FCACHE_BLK - 1) / FCACHE_BLK;
+	for (; i < end && i < fcache.n; i++)
+		if (fcache.known[i]) fcache.known[i] = 0, fcache.dirty = 1;
+}
+
+static void fcache_save(void) {
+	FILE *f; uint32_t i;
+	if (!fcache.fn || !fcache.dirty) return;
+	f = fopen(fcache.fn, "w");
+	if (!f) ERR_EXIT("fopen(\"%s\") failed\n", fcache.fn);
+	fprintf(f, "# mtk_dump flash cache, block 0x%x\n", FCACHE_BLK);
+	for (i = 0; i < fcache.n; i++)
+		if (fcache.known[i])
+			fprintf(f, "0x%08x 0x%08x\n", i * FCACHE_BLK, fcache.crc[i]);
+	if (fclose(f)) ERR_EXIT("fclose(\"%s\") failed\n", fcache.fn);
+	fcache.dirty = 0;
+}
+
+// The file is <dir>/<meid>-<jedec>.crc, one line per known sector.
+static void fcache_open(const char *dir, const char *meid, uint32_t jedec) {
+	char line[256]; unsigned addr, crc, n = 0;
+	FILE *f;
+
+	fcache_save();
+	free(fcache.fn); free(fcache.crc); free(fcache.known);
+	memset(&fcache, 0, sizeof(fcache));
+	fcache.fn = (char*)malloc(strlen(dir) + strlen(meid) + 16);
+	if (!fcache.fn) ERR_EXIT("malloc failed\n");
+	sprintf(fcache.fn, "%s/%s-%06x.crc", dir, meid, jedec);
+	if ((f = fopen(fcache.fn, "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			if (line[0] == '#') continue;
+			if (sscanf(line, "%x %x", &addr, &crc) != 2 || addr & (FCACHE_BLK - 1))
+				ERR_EXIT("bad flash cache line: %s", line);
+			fcache_set(addr, crc);
+			n++;
+		}
+		fclose(f);
+	}
+	fcache.dirty = 0;
+	DBG_LOG("flash cache: \"%s\", %u sectors known\n", fcache.fn, n);
+}
@@ -0,0 +1,112 @@
+
+/* flash timing: the payload returns the erase, page program and
+   WIP wait times of each block it writes */
+
+// as in the reply of the payload, in us
+enum {
+	FTIME_ERASE, FTIME_PROG, FTIME_PROG_MAX, FTIME_PROG_NUM, FTIME_WAIT, FTIME_NUM
+};
+
+// a sector is slow if it takes this many times the median
+#define FTIME_SLOW 3
+#define FTIME_BUCKETS 24
+
+typedef struct {
+	uint32_t addr, erased, t[FTIME_NUM];
+} ftime_rec_t;
+
+static struct {
+	ftime_rec_t *rec;
+	uint32_t n, max;
+} ftime;
+
+static void ftime_add(uint32_t addr, uint32_t erased, const uint32_t *t) {
+	ftime_rec_t *r;
+	if (ftime.n == ftime.max) {
+		ftime.max = ftime.max ? ftime.max * 2 : 256;
+		ftime.rec = (ftime_rec_t*)realloc(ftime.rec, ftime.max * sizeof(ftime_rec_t));
+		if (!ftime.rec) ERR_EXIT("malloc failed\n");
+	}
+	r = &ftime.rec[ftime.n++];
+	r->addr = addr;
+	r->erased = erased;
+	memcpy(r->t, t, sizeof(r->t));
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t ftime_page(const ftime_rec_t *r) {
+	return r->t[FTIME_PROG_NUM] ? r->t[FTIME_PROG] / r->t[FTIME_PROG_NUM] : 0;
+}
+
+// The median erase and page program times, 0 if none.
+static void ftime_typical(uint32_t *erase, uint32_t *page) {
+	uint32_t *e = (uint32_t*)malloc(ftime.n * 8 + 8), *p = e + ftime.n + 1;
+	uint32_t i, ne = 0, np = 0;
+	if (!e) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < ftime.n; i++) {
+		ftime_rec_t *r = &ftime.rec[i];
+		if (r->erased) e[ne++] = r->t[FTIME_ERASE];
+		if (r->t[FTIME_PROG_NUM]) p[np++] = ftime_page(r);
+	}
+	qsort(e, ne, 4, cmp_u32);
+	qsort(p, np, 4, cmp_u32);
+	*erase = ne ? e[ne / 2] : 0;
+	*page = np ? p[np / 2] : 0;
+	free(e);
+}
+
+static unsigned ftime_bucket(uint32_t us) {
+	unsigned i;
+	for (i = 0; i < FTIME_BUCKETS - 1 && us >> (i + 1); i++);
+	return i;
+}
+
+// Prints the histograms of the erase and page program times and the
+// slow sectors, the times of each sector are written to the file.
+static void flash_stats(const char *fn) {
+	uint32_t he[FTIME_BUCKETS] = { 0 }, hp[FTIME_BUCKETS] = { 0 };
+	uint32_t erase, page, i, nerase = 0, slow = 0, last, first;
+	FILE *f = NULL;
+
+	if (!ftime.n) {
+		DBG_LOG("flash_stats: no timing data\n");
+		return;
+	}
+	if (strcmp(fn, "-")) {
+		f = fopen(fn, "w");
+		if (!f) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+		fprintf(f, "# mtk_dump flash timing (us)\n"
+				"# addr erase program pages program_max wait\n");
+	}
+	ftime_typical(&erase, &page);
+	for (i = 0; i < ftime.n; i++) {
+		ftime_rec_t *r = &ftime.rec[i];
+		int is_slow = (r->erased && erase && r->t[FTIME_ERASE] > erase * FTIME_SLOW) ||
+				(page && r->t[FTIME_PROG_MAX] > page * FTIME_SLOW);
+		if (r->erased) he[ftime_bucket(r->t[FTIME_ERASE])]++, nerase++;
+		if (r->t[FTIME_PROG_NUM]) hp[ftime_bucket(ftime_page(r))]++;
+		if (f) fprintf(f, "0x%08x %u %u %u %u %u%s\n", r->addr,
+				r->erased ? r->t[FTIME_ERASE] : 0, r->t[FTIME_PROG], r->t[FTIME_PROG_NUM],
+				r->t[FTIME_PROG_MAX], r->t[FTIME_WAIT], is_slow ? " slow" : "");
+		if (is_slow && slow++ < 20)
+			DBG_LOG("flash_stats: slow sector 0x%08x, erase %u us, page max %u us\n",
+					r->addr, r->erased ? r->t[FTIME_ERASE] : 0, r->t[FTIME_PROG_MAX]);
+	}
+	if (f && fclose(f)) ERR_EXIT("fclose(\"%s\") failed\n", fn);
+
+	printf("flash_stats: %u blocks written, %u erased, %u slow\n", ftime.n, nerase, slow);
+	if (!erase && !page) {
+		printf("no times (the payload has no timer)\n");
+		return;
+	}
+	printf("typical: erase %u us, page program %u us\n", erase, page);
+	for (first = 0; first < FTIME_BUCKETS && !he[first] && !hp[first]; first++);
+	for (last = FTIME_BUCKETS; last > first && !he[last - 1] && !hp[last - 1]; last--);
+	printf("        us     erase   page\n");
+	for (i = first; i < last; i++)
+		printf("  %8u  %8u %6u\n", i ? 1u << i : 0, he[i], hp[i]);
+}
@@ -0,0 +1,204 @@
+/* checks the data kernels against the scalar code on odd lengths and
+   unaligned buffers, "kern_test bench" also prints their speeds */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define READ32_BE(p) ( \
+	((uint8_t*)(p))[0] << 24 | \
+	((uint8_t*)(p))[1] << 16 | \
+	((uint8_t*)(p))[2] << 8 | \
+	((uint8_t*)(p))[3])
+
+#include "kernels.h"
+
+#define TEST_MAX 4200
+#define TEST_ROUNDS 100000
+#define BENCH_SIZE 0x100000
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void) {
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static void ref_swap(uint8_t *p, size_t n, int width) {
+	size_t i; int k; uint8_t a;
+	for (i = 0; i + width <= n; i += width)
+		for (k = 0; k < width / 2; k++) {
+			a = p[i + k]; p[i + k] = p[i + width - 1 - k]; p[i + width - 1 - k] = a;
+		}
+}
+
+static uint32_t ref_sum16(const uint8_t *p, size_t n) {
+	uint32_t sum = 0; uint16_t a; size_t i;
+	for (i = 0; i < n; i++) {
+		memcpy(&a, p + i * 2, 2);
+		sum += a;
+	}
+	return sum;
+}
+
+static uint64_t ref_xor64(const uint8_t *p, size_t n) {
+	uint64_t x = 0, a; size_t i;
+	for (i = 0; i < n; i += 8) {
+		memcpy(&a, p + i, 8);
+		x ^= a;
+	}
+	return x;
+}
+
+static size_t ref_fill(const uint8_t *p, size_t n, int val) {
+	size_t i;
+	for (i = 0; i < n && p[i] == (uint8_t)val; i++);
+	return i;
+}
+
+static size_t ref_eq(const uint8_t *a, const uint8_t *b, size_t n) {
+	size_t i;
+	for (i = 0; i < n && a[i] == b[i]; i++);
+	return i;
+}
+
+static int ref_need_erase(const uint8_t *old, const uint8_t *src, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++)
+		if (~old[i] & src[i]) return 1;
+	return 0;
+}
+
+// Random data, often a run of one value with a flipped bit somewhere,
+// so the vector loops stop at every position.
+static void gen(uint8_t *p, size_t n, int val) {
+	size_t i;
+	for (i = 0; i < n; i++) p[i] = rnd();
+	if (rnd() & 1) {
+		memset(p, val, n);
+		if (n && rnd() & 1) p[rnd() % n] ^= 1 << rnd() % 8;
+	}
+}
+
+static int check(const char *name, int round, size_t n, size_t off, int bad) {
+	if (bad) printf("%s: failed, round %d, length %u, offset %u\n",
+			name, round, (unsigned)n, (unsigned)off);
+	return bad;
+}
+
+static int test(void) {
+	static uint8_t a[TEST_MAX + 32], b[TEST_MAX + 32], c[TEST_MAX + 32], d[TEST_MAX + 32];
+	size_t n, off, k;
+	int i, val, bad = 0;
+
+	for (i = 0; i < TEST_ROUNDS && !bad; i++) {
+		n = rnd() % TEST_MAX;
+		off = rnd() % 32;
+		val = rnd() & 1 ? 0xff : rnd() & 0xff;
+		gen(a, sizeof(a), val);
+		memcpy(b, a, sizeof(b));
+		if (n && rnd() & 1) b[off + rnd() % n] ^= 1 << rnd() % 8;
+
+		memcpy(c, a, sizeof(c)); memcpy(d, a, sizeof(d));
+		k = n & ~(size_t)1;
+		kern_swap(c + off, k, 2); ref_swap(d + off, k, 2);
+		bad |= check("kern_swap 16", i, k, off, memcmp(c, d, sizeof(c)) != 0);
+		k = n & ~(size_t)3;
+		kern_swap(c + off, k, 4); ref_swap(d + off, k, 4);
+		bad |= check("kern_swap 32", i, k, off, memcmp(c, d, sizeof(c)) != 0);
+
+		bad |= check("kern_sum16", i, n / 2, off,
+				kern_sum16(a + off, n / 2) != ref_sum16(a + off, n / 2));
+		k = n & ~(size_t)7;
+		bad |= check("kern_xor64", i, k, off,
+				kern_xor64(a + off, k) != ref_xor64(a + off, k));
+		bad |= check("kern_fill", i, n, off,
+				kern_fill(a + off, n, val) != ref_fill(a + off, n, val));
+		bad |= check("kern_eq", i, n, off,
+				kern_eq(a + off, b + off, n) != ref_eq(a + off, b + off, n));
+		bad |= check("kern_need_erase", i, n, off,
+				kern_need_erase(a + off, b + off, n) != ref_need_erase(a + off, b + off, n));
+		// erased and zero flash
+		memset(c, 0xff, sizeof(c));
+		bad |= check("kern_need_erase", i, n, off,
+				kern_need_erase(c, a + off, n) != ref_need_erase(c, a + off, n));
+		memset(c, 0, sizeof(c));
+		bad |= check("kern_need_erase", i, n, off,
+				kern_need_erase(c, a + off, n) != ref_need_erase(c, a + off, n));
+	}
+	return bad;
+}
+
+// volatile, so the compiler doesn't specialise the kernels for it
+static volatile size_t bench_size = BENCH_SIZE;
+
+static double rate(clock_t t, int rounds) {
+	double s = (double)(clock() - t) / CLOCKS_PER_SEC;
+	return s > 0 ? BENCH_SIZE / 1e6 * rounds / s : 0;
+}
+
+static void bench(void) {
+	static uint8_t a[BENCH_SIZE + 1], b[BENCH_SIZE + 1];
+	volatile size_t sink = 0;
+	size_t n = bench_size;
+	clock_t t; int r, rounds = 500;
+	double k, s;
+
+	// unaligned by one byte
+	memset(a, 0xff, sizeof(a)); memset(b, 0xff, sizeof(b));
+	printf("%-12s %8s %8s (MB/s)\n", "", "kernel", "scalar");
+#define BENCH(name, kern, ref) \
+	t = clock(); for (r = 0; r < rounds; r++) kern; k = rate(t, rounds); \
+	t = clock(); for (r = 0; r < rounds; r++) ref; s = rate(t, rounds); \
+	printf("%-12s %8.0f %8.0f\n", name, k, s);
+	BENCH("swap 16", kern_swap(a + 1, n, 2), ref_swap(a + 1, n, 2))
+	BENCH("swap 32", kern_swap(a + 1, n, 4), ref_swap(a + 1, n, 4))
+	BENCH("sum16", sink += kern_sum16(a + 1, n / 2),
+			sink += ref_sum16(a + 1, n / 2))
+	BENCH("xor64", sink += kern_xor64(a + 1, n),
+			sink += ref_xor64(a + 1, n))
+	BENCH("fill", sink += kern_fill(a + 1, n, 0xff),
+			sink += ref_fill(a + 1, n, 0xff))
+	BENCH("eq", sink += kern_eq(a + 1, b, n),
+			sink += ref_eq(a + 1, b, n))
+	BENCH("need_erase", sink += kern_need_erase(a + 1, b, n),
+			sink += ref_need_erase(a + 1, b, n))
+#undef BENCH
+	(void)sink;
+}
+
+static int run(const char *simd, int do_bench) {
+	int bad;
+#ifdef KERN_AVX2
+	printf("kern_test: %s%s\n", simd, kern_avx2 ? ", AVX2" : "");
+#else
+	printf("kern_test: %s\n", simd);
+#endif
+	bad = test();
+	if (do_bench) bench();
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	int do_bench = argc > 1 && !strcmp(argv[1], "bench"), bad;
+	const char *simd = "scalar";
+
+#if defined(__SSE2__)
+	simd = "SSE2";
+#elif defined(__ARM_NEON)
+	simd = "NEON";
+#endif
+	kern_init();
+	bad = run(simd, do_bench);
+#ifdef KERN_AVX2
+	// the same again without AVX2
+	if (kern_avx2) {
+		kern_avx2 = 0;
+		bad |= run(simd, do_bench);
+	}
+#endif
+	printf("kern_test: %s\n", bad ? "FAILED" : "OK");
+	return bad;
+}
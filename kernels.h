@@ -0,0 +1,230 @@
+
+/* data kernels: SSE2 (and AVX2 if the CPU has it) on x86, NEON on ARM,
+   the scalar code is used for the tails and on other hosts */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(NO_AVX2)
+#include <immintrin.h>
+#define KERN_AVX2 1
+#define KERN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef KERN_AVX2
+// must be set before the threads are started
+static int kern_avx2 = 0;
+#endif
+
+static void kern_init(void) {
+#ifdef KERN_AVX2
+	__builtin_cpu_init();
+	kern_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#ifdef KERN_AVX2
+KERN_TARGET_AVX2
+static size_t kern_swap_avx2(uint8_t *p, size_t n, int width) {
+	const __m256i m16 = _mm256_setr_epi8(
+			1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+			1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	const __m256i m32 = _mm256_setr_epi8(
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i m = width == 2 ? m16 : m32;
+	size_t i;
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+		_mm256_storeu_si256((__m256i*)(p + i), _mm256_shuffle_epi8(x, m));
+	}
+	return i;
+}
+#endif
+
+// Swaps the bytes of big-endian 16/32-bit words in place.
+static void kern_swap(uint8_t *p, size_t n, int width) {
+	size_t i = 0;
+	uint32_t a;
+#ifdef KERN_AVX2
+	if (kern_avx2) i = kern_swap_avx2(p, n, width);
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+		if (width == 4) {
+			x = _mm_shufflelo_epi16(x, 0xb1);
+			x = _mm_shufflehi_epi16(x, 0xb1);
+		}
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i*)(p + i), x);
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t x = vld1q_u8(p + i);
+		vst1q_u8(p + i, width == 2 ? vrev16q_u8(x) : vrev32q_u8(x));
+	}
+#endif
+	if (width == 2)
+		for (; i + 2 <= n; i += 2) {
+			a = p[i]; p[i] = p[i + 1]; p[i + 1] = a;
+		}
+	else
+		for (; i + 4 <= n; i += 4) {
+			a = READ32_BE(p + i);
+			p[i + 0] = a; p[i + 1] = a >> 8;
+			p[i + 2] = a >> 16; p[i + 3] = a >> 24;
+		}
+}
+
+// The sum of n native 16-bit words (modulo 2^32).
+static uint32_t kern_sum16(const uint8_t *p, size_t n) {
+	uint32_t sum = 0;
+	uint16_t a;
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i z = _mm_setzero_si128(), acc = z;
+	uint32_t t[4];
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(p + i * 2));
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(x, z));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(x, z));
+	}
+	_mm_storeu_si128((__m128i*)t, acc);
+	sum = t[0] + t[1] + t[2] + t[3];
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+	for (; i + 8 <= n; i += 8)
+		acc = vpadalq_u16(acc, vld1q_u16((const uint16_t*)(p + i * 2)));
+	sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+			vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+	for (; i < n; i++) {
+		memcpy(&a, p + i * 2, 2);
+		sum += a;
+	}
+	return sum;
+}
+
+// XOR of the 64-bit words, n must be a multiple of 8.
+static uint64_t kern_xor64(const uint8_t *p, size_t n) {
+	uint64_t a, x = 0;
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	uint64_t t[2];
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+	_mm_storeu_si128((__m128i*)t, acc);
+	x = t[0] ^ t[1];
+#elif defined(__ARM_NEON)
+	uint64x2_t acc = vdupq_n_u64(0);
+	for (; i + 16 <= n; i += 16)
+		acc = veorq_u64(acc, vreinterpretq_u64_u8(vld1q_u8(p + i)));
+	x = vgetq_lane_u64(acc, 0) ^ vgetq_lane_u64(acc, 1);
+#endif
+	for (; i < n; i += 8) {
+		memcpy(&a, p + i, 8);
+		x ^= a;
+	}
+	return x;
+}
+
+#ifdef KERN_AVX2
+KERN_TARGET_AVX2
+static size_t kern_fill_avx2(const uint8_t *p, size_t n, int val) {
+	__m256i v = _mm256_set1_epi8(val);
+	size_t i;
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, v)) != -1) break;
+	}
+	return i;
+}
+
+KERN_TARGET_AVX2
+static size_t kern_eq_avx2(const uint8_t *a, const uint8_t *b, size_t n) {
+	size_t i;
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != -1) break;
+	}
+	return i;
+}
+#endif
+
+#if defined(__ARM_NEON)
+static int kern_all_neon(uint8x16_t x) {
+	uint64x2_t a = vreinterpretq_u64_u8(x);
+	return (vgetq_lane_u64(a, 0) & vgetq_lane_u64(a, 1)) == ~(uint64_t)0;
+}
+#endif
+
+// Returns the index of the first byte not equal to val, or n.
+static size_t kern_fill(const uint8_t *p, size_t n, int val) {
+	size_t i = 0;
+#ifdef KERN_AVX2
+	if (kern_avx2) i = kern_fill_avx2(p, n, val);
+#endif
+#if defined(__SSE2__)
+	{
+		__m128i v = _mm_set1_epi8(val);
+		for (; i + 16 <= n; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, v)) != 0xffff) break;
+		}
+	}
+#elif defined(__ARM_NEON)
+	{
+		uint8x16_t v = vdupq_n_u8(val);
+		for (; i + 16 <= n; i += 16)
+			if (!kern_all_neon(vceqq_u8(vld1q_u8(p + i), v))) break;
+	}
+#endif
+	for (; i < n && p[i] == (uint8_t)val; i++);
+	return i;
+}
+
+// Returns the length of the common prefix.
+static size_t kern_eq(const uint8_t *a, const uint8_t *b, size_t n) {
+	size_t i = 0;
+#ifdef KERN_AVX2
+	if (kern_avx2) i = kern_eq_avx2(a, b, n);
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) break;
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16)
+		if (!kern_all_neon(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i)))) break;
+#endif
+	for (; i < n && a[i] == b[i]; i++);
+	return i;
+}
+
+// Checks if any bit goes from 0 to 1 (the flash must be erased).
+static int kern_need_erase(const uint8_t *old, const uint8_t *src, size_t n) {
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i z = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(old + i)),
+				_mm_loadu_si128((const __m128i*)(src + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, z)) != 0xffff) return 1;
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16) {
+		uint64x2_t x = vreinterpretq_u64_u8(vbicq_u8(vld1q_u8(src + i), vld1q_u8(old + i)));
+		if (vgetq_lane_u64(x, 0) | vgetq_lane_u64(x, 1)) return 1;
+	}
+#endif
+	for (; i < n; i++)
+		if (~old[i] & src[i]) return 1;
+	return 0;
+}
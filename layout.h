@@ -0,0 +1,239 @@
+
+/* flash layout: the size from SFDP or the JEDEC ID, the blank sectors
+   from checksums computed by the payload and the chain of MAUI image
+   headers (GFH), "read_flash <addr> auto" reads up to the last used sector */
+
+#define LAYOUT_BLK FCACHE_BLK
+#define LAYOUT_MAX 64
+// the 4K slots after an image checked for the next header
+#define GFH_SCAN 16
+#define GFH_FILE_INFO "MMM\1\x38\0\0\0FILE_INFO\0\0\0"
+#define GFH_FILE_INFO_LEN 0x38
+
+enum { REGION_DATA = -1 };
+
+typedef struct {
+	uint32_t addr, size;
+	// the GFH file type or REGION_DATA
+	int type;
+} region_t;
+
+static struct {
+	uint32_t size, used, nblk;
+	// NULL if the payload can't hash the flash
+	uint8_t *blank;
+	region_t reg[LAYOUT_MAX];
+	unsigned nreg;
+	// flash_written at the time of the scan
+	int written, done;
+} layout;
+
+static int dump_regions = 0;
+
+static const char* region_name(int type) {
+	switch (type) {
+	case REGION_DATA: return "data";
+	case 1: return "bootloader";
+	case 2: return "ext_bootloader";
+	}
+	return type >> 8 == 1 ? "maui" : "image";
+}
+
+// SFDP if the flash has it, otherwise the capacity byte of the JEDEC ID.
+static uint32_t flash_density(usbio_t *io) {
+	uint8_t buf[256], msg[] = { 0x9f };
+	uint64_t n;
+	unsigned c;
+
+	sfi_read_sfdp(io, 0, buf, sizeof(buf));
+	if (!(n = sfdp_density(buf))) {
+		sfi_cmd(io, 0, msg, 1, 3);
+		c = io->buf[2];
+		if (c - 16 > 31 - 16) ERR_EXIT("layout: unknown flash size\n");
+		n = (uint64_t)1 << c;
+	}
+	// the rest isn't addressable
+	if (n >> 32) n = 0x80000000;
+	return n;
+}
+
+static int layout_blank(uint32_t addr) {
+	uint32_t i = addr / LAYOUT_BLK;
+	return layout.blank && i < layout.nblk && layout.blank[i];
+}
+
+static void layout_read(usbio_t *io, uint32_t addr, uint8_t *buf, uint32_t size) {
+	int path = fpath_out;
+	if (FPATH_IS_XIP(fpath_main) && addr + size <= XIP_SIZE) path = fpath_main;
+	if (!path) ERR_EXIT("layout: 0x%08x is outside the mapped window\n", addr);
+	fpath_read_buf(io, path, addr, buf, size);
+}
+
+static void layout_add(uint32_t addr, uint32_t size, int type) {
+	region_t *r;
+	if (layout.nreg == LAYOUT_MAX) return;
+	r = &layout.reg[layout.nreg++];
+	r->addr = addr; r->size = size; r->type = type;
+}
+
+// Follows the images from the start of the flash, each one starts
+// with a FILE_INFO header giving its length, the next one is expected
+// in the first few used sectors after it.
+static void layout_gfh(usbio_t *io) {
+	uint8_t hdr[GFH_FILE_INFO_LEN];
+	uint64_t next;
+	uint32_t addr = 0, len;
+	unsigned i;
+
+	for (;;) {
+		layout_read(io, addr, hdr, sizeof(hdr));
+		if (memcmp(hdr, GFH_FILE_INFO, 0x14)) break;
+		len = READ32_LE(hdr + 0x20);
+		if (!len || len > layout.size - addr) break;
+		layout_add(addr, len, hdr[0x18] | hdr[0x19] << 8);
+		if (io->verbose)
+			DBG_LOG("layout: 0x%08x 0x%08x %s, type 0x%04x, load 0x%08x\n",
+					addr, len, region_name(layout.reg[layout.nreg - 1].type),
+					layout.reg[layout.nreg - 1].type, READ32_LE(hdr + 0x1c));
+		next = ((uint64_t)addr + len + LAYOUT_BLK - 1) & -LAYOUT_BLK;
+		for (i = 0; i < GFH_SCAN; next += LAYOUT_BLK) {
+			if (next + sizeof(hdr) > layout.size) return;
+			if (layout_blank(next)) continue;
+			layout_read(io, next, hdr, sizeof(hdr));
+			if (!memcmp(hdr, GFH_FILE_INFO, 0x14)) break;
+			i++;
+		}
+		if (i == GFH_SCAN) break;
+		addr = next;
+	}
+}
+
+static int region_cmp(const void *a, const void *b) {
+	const region_t *x = (const region_t*)a, *y = (const region_t*)b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void layout_scan(usbio_t *io) {
+	uint32_t *crc, i, end, n, nimg;
+	uint64_t a;
+
+	if (layout.done && layout.written == flash_written) return;
+	free(layout.blank);
+	memset(&layout, 0, sizeof(layout));
+	layout.size = flash_density(io);
+	layout.nblk = layout.size / LAYOUT_BLK;
+	fpath_select(io, 0);
+
+	if (pl_caps & PL_CAP_READ_HASH) {
+		crc = (uint32_t*)malloc(layout.nblk * sizeof(uint32_t));
+		layout.blank = (uint8_t*)malloc(layout.nblk);
+		if (!crc || !layout.blank) ERR_EXIT("malloc failed\n");
+		pl_hash(io, 0, layout.size, crc);
+		for (i = 0; i < layout.nblk; i++) {
+			layout.blank[i] = crc[i] == blank_crc();
+			fcache_set(i * LAYOUT_BLK, crc[i]);
+		}
+		fcache_save();
+		free(crc);
+	}
+	layout_gfh(io);
+
+	// the used sectors outside the images (resources, NVRAM)
+	nimg = layout.nreg;
+	if (layout.blank) {
+		for (i = 0; i < layout.nblk; i = end) {
+			for (; i < layout.nblk && layout.blank[i]; i++);
+			for (end = i; end < layout.nblk && !layout.blank[end]; end++);
+			if (i == end) break;
+			a = (uint64_t)i * LAYOUT_BLK;
+			for (n = 0; n < nimg && a < (uint64_t)end * LAYOUT_BLK; n++) {
+				region_t *r = &layout.reg[n];
+				uint64_t s = r->addr & -LAYOUT_BLK;
+				uint64_t e = ((uint64_t)r->addr + r->size + LAYOUT_BLK - 1) & -LAYOUT_BLK;
+				if (e <= a || s >= (uint64_t)end * LAYOUT_BLK) continue;
+				if (s > a) layout_add(a, s - a, REGION_DATA);
+				a = e;
+			}
+			if (a < (uint64_t)end * LAYOUT_BLK)
+				layout_add(a, end * LAYOUT_BLK - a, REGION_DATA);
+			layout.used = end * LAYOUT_BLK;
+		}
+	} else layout.used = layout.size;
+	qsort(layout.reg, layout.nreg, sizeof(region_t), region_cmp);
+	for (i = 0; i < nimg; i++) {
+		region_t *r = &layout.reg[i];
+		if (layout.used < r->addr + r->size) layout.used = r->addr + r->size;
+	}
+
+	layout.written = flash_written;
+	layout.done = 1;
+	DBG_LOG("layout: flash 0x%x, used 0x%x, %u images, %u regions%s\n",
+			layout.size, layout.used, nimg, layout.nreg,
+			layout.blank ? "" : " (no blank map)");
+}
+
+static void layout_save(const char *fn, uint32_t addr, uint32_t size) {
+	char *mapfn = sidecar_name(fn, ".regions");
+	uint64_t end = (uint64_t)addr + size;
+	unsigned i;
+	FILE *f = fopen(mapfn, "w");
+
+	if (!f) ERR_EXIT("fopen(\"%s\") failed\n", mapfn);
+	fprintf(f, "# mtk_dump region map\n"
+			"# addr 0x%08x size 0x%x flash 0x%x\n", addr, size, layout.size);
+	for (i = 0; i < layout.nreg; i++) {
+		region_t *r = &layout.reg[i];
+		if (r->addr + r->size <= addr || r->addr >= end) continue;
+		fprintf(f, "0x%08x 0x%08x %s", r->addr, r->size, region_name(r->type));
+		if (r->type != REGION_DATA) fprintf(f, " 0x%04x", r->type);
+		fprintf(f, "\n");
+	}
+	if (fclose(f)) ERR_EXIT("fclose(\"%s\") failed\n", mapfn);
+	free(mapfn);
+}
+
+// The size of "read_flash <addr> auto", up to the last used sector.
+static uint32_t layout_auto(usbio_t *io, uint32_t addr, const char *fn) {
+	uint32_t size;
+	layout_scan(io);
+	size = addr < layout.used ? layout.used - addr : 0;
+	if (dump_regions && strcmp(fn, "-")) layout_save(fn, addr, size);
+	return size;
+}
+
+// Like read_flash_range(), the blank sectors found by the scan aren't read.
+static uint32_t read_flash_used(usbio_t *io,
+		uint32_t off, uint32_t end, dumpout_t *fo) {
+	static uint8_t blank[LAYOUT_BLK];
+	uint64_t n;
+
+	if (!layout.blank || layout.written != flash_written)
+		return read_flash_range(io, off, end, fo);
+	if (!blank[0]) memset(blank, 0xff, sizeof(blank));
+	while (off < end) {
+		n = ((uint64_t)off + LAYOUT_BLK) & -LAYOUT_BLK;
+		if (layout_blank(off)) {
+			if (n > end) n = end;
+			dumpout_write(fo, blank, n - off);
+			off = n;
+			continue;
+		}
+		for (; n < end && !layout_blank(n); n += LAYOUT_BLK);
+		if (n > end) n = end;
+		off = read_flash_range(io, off, n, fo);
+		if (off < n) break;
+	}
+	return off;
+}
+
+static unsigned dump_flash(usbio_t *io,
+		uint32_t start, uint32_t len, const char *fn) {
+	uint32_t off;
+	dumpout_t *fo;
+
+	fo = dumpout_open(fn, "read_flash", start, len);
+	off = read_flash_used(io, start + fo->pos, start + len, fo);
+	DBG_LOG("dump_flash: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, off - start);
+	dumpout_close(fo);
+	return off;
+}
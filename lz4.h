@@ -0,0 +1,159 @@
+
+/* LZ4 block format, compatible with the payload decoder */
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static uint8_t* lz4_put_len(uint8_t *d, unsigned n) {
+	for (; n >= 255; n -= 255) *d++ = 255;
+	*d++ = n;
+	return d;
+}
+
+// Returns the compressed size, or 0 if it doesn't fit in cap bytes.
+static unsigned lz4_compress(const uint8_t *src, unsigned n, uint8_t *dst, unsigned cap) {
+	uint32_t tab[1 << LZ4_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *end = src + n, *ref;
+	const uint8_t *mflimit = n > LZ4_MF_LIMIT ? end - LZ4_MF_LIMIT : src;
+	const uint8_t *mlimit = end - LZ4_LAST_LITERALS;
+	uint8_t *d = dst, *dend = dst + cap, *token;
+	unsigned h, lit, len;
+
+	// positions are stored plus one, zero means empty
+	memset(tab, 0, sizeof(tab));
+	while (ip < mflimit) {
+		uint32_t seq;
+		memcpy(&seq, ip, 4);
+		h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		len = tab[h];
+		tab[h] = ip - src + 1;
+		if (!len) { ip++; continue; }
+		ref = src + len - 1;
+		if (ip - ref > 0xffff || memcmp(ref, ip, 4)) {
+			ip++; continue;
+		}
+		for (len = LZ4_MIN_MATCH; ip + len < mlimit && ref[len] == ip[len]; len++);
+
+		lit = ip - anchor;
+		// worst case for the sequence header
+		if (dend - d < (int)(lit + lit / 255 + len / 255 + 8)) return 0;
+		token = d++;
+		*token = (lit < 15 ? lit : 15) << 4;
+		if (lit >= 15) d = lz4_put_len(d, lit - 15);
+		memcpy(d, anchor, lit); d += lit;
+		*d++ = ip - ref; *d++ = (ip - ref) >> 8;
+		len -= LZ4_MIN_MATCH;
+		*token |= len < 15 ? len : 15;
+		if (len >= 15) d = lz4_put_len(d, len - 15);
+		ip += len + LZ4_MIN_MATCH;
+		anchor = ip;
+	}
+
+	lit = end - anchor;
+	if (dend - d < (int)(lit + lit / 255 + 2)) return 0;
+	token = d++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15) d = lz4_put_len(d, lit - 15);
+	memcpy(d, anchor, lit); d += lit;
+	return d - dst;
+}
+
+// Decodes a block to dst + pos, matches may refer to the data before pos.
+// Returns the decoded size or -1.
+static int lz4_decompress(const uint8_t *src, size_t slen,
+		uint8_t *dst, size_t pos, size_t dlen) {
+	const uint8_t *end = src + slen, *ref;
+	uint8_t *d = dst + pos, *dend = dst + dlen;
+	size_t n, off; unsigned token, a;
+
+	while (src < end) {
+		token = *src++;
+		n = token >> 4;
+		if (n == 15) do {
+			if (src >= end) return -1;
+			n += a = *src++;
+		} while (a == 255);
+		if (n > (size_t)(end - src) || n > (size_t)(dend - d)) return -1;
+		memcpy(d, src, n); d += n; src += n;
+		if (src >= end) break;
+
+		if (end - src < 2) return -1;
+		off = src[0] | src[1] << 8; src += 2;
+		if (!off || off > (size_t)(d - dst)) return -1;
+		n = (token & 15) + LZ4_MIN_MATCH;
+		if (n == 15 + LZ4_MIN_MATCH) do {
+			if (src >= end) return -1;
+			n += a = *src++;
+		} while (a == 255);
+		if (n > (size_t)(dend - d)) return -1;
+		ref = d - off;
+		while (n--) *d++ = *ref++;
+	}
+	return d - (dst + pos);
+}
+
+#define LZ4_FRAME_MAGIC 0x184d2204
+
+// Decodes the LZ4 frame format (as written by the lz4 utility).
+static uint8_t* lz4_decode_frame(const uint8_t *src, size_t slen, size_t *num) {
+	const uint8_t *end = src + slen;
+	uint8_t *dst = NULL;
+	size_t pos = 0, cap = 0;
+	unsigned flg, bmax;
+
+	while (end - src >= 4) {
+		uint32_t magic = READ32_LE(src), bsize;
+		src += 4;
+		if ((magic & ~15u) == 0x184d2a50) { // skippable frame
+			if (end - src < 4) break;
+			bsize = READ32_LE(src); src += 4;
+			if (bsize > (size_t)(end - src)) break;
+			src += bsize;
+			continue;
+		}
+		if (magic != LZ4_FRAME_MAGIC || end - src < 3) break;
+		flg = src[0];
+		if ((flg >> 6) != 1) break;
+		bmax = 1 << (((src[1] >> 4) & 7) * 2 + 8);
+		src += 3 + (flg >> 3 & 1) * 8 + (flg & 1) * 4;
+		if (src > end) break;
+
+		for (;;) {
+			int ret;
+			if (end - src < 4) goto err;
+			bsize = READ32_LE(src); src += 4;
+			if (!bsize) break;
+			if ((bsize & 0x7fffffff) > (size_t)(end - src)) goto err;
+			if (cap - pos < bmax) {
+				uint8_t *p;
+				cap = cap * 2 + bmax;
+				p = (uint8_t*)realloc(dst, cap);
+				if (!p) goto err;
+				dst = p;
+			}
+			if (bsize >> 31) {
+				bsize &= 0x7fffffff;
+				if (bsize > bmax) goto err;
+				memcpy(dst + pos, src, bsize);
+				ret = bsize;
+			} else {
+				// blocks may be linked, so the output is kept contiguous
+				ret = lz4_decompress(src, bsize, dst, pos, pos + bmax);
+				if (ret < 0) goto err;
+			}
+			src += bsize; pos += ret;
+			if (flg & 0x10) src += 4; // block checksum
+		}
+		if (flg & 4) src += 4; // content checksum
+		if (src > end) goto err;
+		if (src == end) {
+			if (num) *num = pos;
+			return dst;
+		}
+	}
+err:
+	free(dst);
+	return NULL;
+}
@@ -0,0 +1,113 @@
+
+/* dump manifests: SHA-256 of the file and crc32 of each 4K block,
+   hashed by a worker thread while the dump is received */
+
+#define MANIFEST_BLK RING_BLK
+#define MANIFEST_RING 16
+
+typedef struct {
+	char *fn;
+	uint32_t addr, size;
+	ring_t *ring;
+	sha256_t sha;
+	uint32_t *crc, nblk;
+} manifest_t;
+
+static void manifest_block(void *ctx, const uint8_t *buf, uint32_t len) {
+	manifest_t *m = (manifest_t*)ctx;
+	sha256_update(&m->sha, buf, len);
+	m->crc[m->nblk++] = crc32(0, buf, len);
+}
+
+// The name is freed by manifest_close().
+static manifest_t* manifest_open(char *fn, uint32_t addr, uint32_t size) {
+	manifest_t *m = (manifest_t*)calloc(1, sizeof(manifest_t));
+	if (!m) ERR_EXIT("malloc failed\n");
+	m->fn = fn;
+	m->addr = addr;
+	m->size = size;
+	m->crc = (uint32_t*)malloc(((uint64_t)size + MANIFEST_BLK - 1) / MANIFEST_BLK * 4 + 4);
+	if (!m->crc) ERR_EXIT("malloc failed\n");
+	sha256_init(&m->sha);
+	// the table is filled before the thread uses it
+	crc32(0, NULL, 0);
+	m->ring = ring_open(MANIFEST_RING, manifest_block, m);
+	return m;
+}
+
+static void manifest_feed(manifest_t *m, const uint8_t *buf, uint32_t len) {
+	ring_write(m->ring, buf, len);
+}
+
+// Feeds a part of a resumed dump, blank and fill blocks may be holes.
+static void manifest_replay(manifest_t *m, FILE *f,
+		uint64_t pos, uint64_t len, int val) {
+	uint8_t buf[MANIFEST_BLK]; uint32_t n, k;
+	for (; len; pos += n, len -= n) {
+		n = len < MANIFEST_BLK ? len : MANIFEST_BLK;
+		if (val < 0) {
+			k = 0;
+			if (!fseek(f, pos, SEEK_SET)) k = fread(buf, 1, n, f);
+			memset(buf + k, 0, n - k);
+		} else memset(buf, val, n);
+		manifest_feed(m, buf, n);
+	}
+}
+
+// Written only if the dump is complete.
+static void manifest_close(manifest_t *m, int complete) {
+	uint8_t sha[32]; uint32_t i;
+	FILE *f;
+
+	ring_close(m->ring);
+	sha256_final(&m->sha, sha);
+
+	if (!complete) remove(m->fn);
+	else {
+		if (!(f = fopen(m->fn, "w")))
+			ERR_EXIT("fopen(\"%s\") failed\n", m->fn);
+		fprintf(f, "# mtk_dump manifest\n"
+				"# addr 0x%08x size 0x%x block 0x%x\nsha256 ", m->addr, m->size, MANIFEST_BLK);
+		for (i = 0; i < 32; i++) fprintf(f, "%02x", sha[i]);
+		fprintf(f, "\n");
+		for (i = 0; i < m->nblk; i++) fprintf(f, "%08x\n", m->crc[i]);
+		if (fclose(f)) ERR_EXIT("fclose(\"%s\") failed\n", m->fn);
+	}
+	free(m->crc); free(m->fn);
+	free(m);
+}
+
+// Loads the block checksums and the SHA-256 of a manifest.
+static uint32_t* manifest_load(const char *fn,
+		uint32_t *size, uint32_t *nblk, uint8_t *sha) {
+	char line[256]; unsigned a, b, c, i, n = 0;
+	uint32_t *crc = NULL;
+	FILE *f = fopen(fn, "r");
+	int have_sha = 0;
+
+	if (!f) return NULL;
+	*size = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "# addr %x size %x block %x", &a, &b, &c) == 3) {
+			if (c != MANIFEST_BLK) ERR_EXIT("%s: unsupported block size\n", fn);
+			*size = b;
+			crc = (uint32_t*)malloc(((uint64_t)b + MANIFEST_BLK - 1) / MANIFEST_BLK * 4 + 4);
+			if (!crc) ERR_EXIT("malloc failed\n");
+		} else if (line[0] == '#') continue;
+		else if (!strncmp(line, "sha256 ", 7)) {
+			for (i = 0; i < 32; i++) {
+				if (sscanf(line + 7 + i * 2, "%2x", &a) != 1)
+					ERR_EXIT("%s: bad sha256\n", fn);
+				sha[i] = a;
+			}
+			have_sha = 1;
+		} else if (crc && n * (uint64_t)MANIFEST_BLK < *size && sscanf(line, "%x", &a) == 1)
+			crc[n++] = a;
+		else ERR_EXIT("%s: bad line: %s", fn, line);
+	}
+	fclose(f);
+	if (!have_sha || !crc || n * (uint64_t)MANIFEST_BLK < *size)
+		ERR_EXIT("%s: incomplete manifest\n", fn);
+	*nblk = n;
+	return crc;
+}
@@ -30,10 +30,14 @@
 #include <libusb-1.0/libusb.h>
 #else
 #include <termios.h>
-#include <fcntl.h>
 #include <poll.h>
 #endif
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mtk_cmd.h"
 
@@ -79,8 +83,20 @@ static void print_string(FILE *f, uint8_t *buf, size_t n) {
 
 #define DBG_LOG(...) fprintf(stderr, __VA_ARGS__)
 
-#define RECV_BUF_LEN 1024
-#define TEMP_BUF_LEN 1024
+/* protocol errors are recoverable inside io_begin/io_end */
+#define IO_FAIL(io, ...) do { \
+	if (!(io)->recover) ERR_EXIT(__VA_ARGS__); \
+	if (!(io)->err && (io)->verbose) DBG_LOG(__VA_ARGS__); \
+	(io)->err = 1; \
+} while (0)
+
+#define RECV_BUF_LEN 0x4000
+#define TEMP_BUF_LEN 0x2000
+
+// transfer sizes, set or probed with the "chunk" command
+static struct {
+	unsigned brom_read, sfi_read, upload, pl_read, pl_write;
+} chunk = { 1024, 128, 0x4000, 0x1000, 0x1000 };
 
 typedef struct {
 	uint8_t *recv_buf, *buf;
@@ -90,13 +106,17 @@ typedef struct {
 #else
 	int serial;
 #endif
+	// wMaxPacketSize, 0 for the serial
+	int packet_in, packet_out;
 	int flags, recv_len, recv_pos, nread;
 	int verbose, timeout;
+	int err, recover, max_retries;
+	unsigned stat_errors, stat_retries, stat_resyncs;
 } usbio_t;
 
 #if USE_LIBUSB
-static void find_endpoints(libusb_device_handle *dev_handle, int result[2]) {
-	int endp_in = -1, endp_out = -1;
+static void find_endpoints(libusb_device_handle *dev_handle, int result[4]) {
+	int endp_in = -1, endp_out = -1, packet_in = 0, packet_out = 0;
 	int i, k, err;
 	//struct libusb_device_descriptor desc;
 	struct libusb_config_descriptor *config;
@@ -125,10 +145,12 @@ static void find_endpoints(libusb_device_handle *dev_handle, int result[2]) {
 				if (addr & 0x80) {
 					if (endp_in >= 0) ERR_EXIT("more than one endp_in\n");
 					endp_in = addr;
+					packet_in = endpoint->wMaxPacketSize & 0x7ff;
 					claim = 1;
 				} else {
 					if (endp_out >= 0) ERR_EXIT("more than one endp_out\n");
 					endp_out = addr;
+					packet_out = endpoint->wMaxPacketSize & 0x7ff;
 					claim = 1;
 				}
 			}
@@ -158,6 +180,8 @@ static void find_endpoints(libusb_device_handle *dev_handle, int result[2]) {
 
 	result[0] = endp_in;
 	result[1] = endp_out;
+	result[2] = packet_in;
+	result[3] = packet_out;
 }
 #else
 static void init_serial(int serial) {
@@ -188,7 +212,7 @@ static usbio_t* usbio_init(int serial, int flags) {
 	uint8_t *p; usbio_t *io;
 
 #if USE_LIBUSB
-	int endpoints[2];
+	int endpoints[4];
 	find_endpoints(dev_handle, endpoints);
 #else
 	init_serial(serial);
@@ -204,8 +228,11 @@ static usbio_t* usbio_init(int serial, int flags) {
 	io->dev_handle = dev_handle;
 	io->endp_in = endpoints[0];
 	io->endp_out = endpoints[1];
+	io->packet_in = endpoints[2];
+	io->packet_out = endpoints[3];
 #else
 	io->serial = serial;
+	io->packet_in = io->packet_out = 0;
 #endif
 	io->recv_len = 0;
 	io->recv_pos = 0;
@@ -213,6 +240,10 @@ static usbio_t* usbio_init(int serial, int flags) {
 	io->buf = p;
 	io->verbose = 0;
 	io->timeout = 1000;
+	io->err = 0;
+	io->recover = 0;
+	io->max_retries = 5;
+	io->stat_errors = io->stat_retries = io->stat_resyncs = 0;
 	return io;
 }
 
@@ -238,6 +269,13 @@ static void usbio_free(usbio_t* io) {
 	((uint8_t*)(p))[3] = (uint8_t)(a); \
 } while (0)
 
+#define WRITE32_LE(p, a) do { \
+	((uint8_t*)(p))[0] = (uint8_t)(a); \
+	((uint8_t*)(p))[1] = (uint8_t)((a) >> 8); \
+	((uint8_t*)(p))[2] = (uint8_t)((a) >> 16); \
+	((uint8_t*)(p))[3] = (uint8_t)((a) >> 24); \
+} while (0)
+
 #define READ16_BE(p) ( \
 	((uint8_t*)(p))[0] << 8 | \
 	((uint8_t*)(p))[1])
@@ -260,6 +298,7 @@ static int usb_send(usbio_t *io, const void *data, int len) {
 
 	if (!buf) buf = io->buf;
 	if (!len) ERR_EXIT("empty message\n");
+	if (io->err) return len;
 	if (io->verbose >= 2) {
 		DBG_LOG("send (%d):\n", len);
 		print_mem(stderr, buf, len);
@@ -269,14 +308,19 @@ static int usb_send(usbio_t *io, const void *data, int len) {
 	{
 		int err = libusb_bulk_transfer(io->dev_handle,
 				io->endp_out, (uint8_t*)buf, len, &ret, io->timeout);
-		if (err < 0)
+		if (err == LIBUSB_ERROR_TIMEOUT) {
+			IO_FAIL(io, "usb_send timeout\n");
+			return len;
+		} else if (err < 0)
 			ERR_EXIT("usb_send failed : %s\n", libusb_error_name(err));
 	}
 #else
 	ret = write(io->serial, buf, len);
 #endif
-	if (ret != len)
-		ERR_EXIT("usb_send failed (%d / %d)\n", ret, len);
+	if (ret != len) {
+		IO_FAIL(io, "usb_send failed (%d / %d)\n", ret, len);
+		return len;
+	}
 
 #if !USE_LIBUSB
 	tcdrain(io->serial);
@@ -288,15 +332,24 @@ static int usb_send(usbio_t *io, const void *data, int len) {
 static int usb_recv(usbio_t *io, int plen) {
 	uint8_t *buf = io->buf;
 	int a, pos, len, nread = 0;
+#if USE_LIBUSB
+	int zlp = 0;
+#endif
 	if (plen > TEMP_BUF_LEN)
 		ERR_EXIT("target length too long\n");
+	if (io->err) return io->nread = 0;
 
 	len = io->recv_len;
 	pos = io->recv_pos;
 	while (nread < plen) {
 		if (pos >= len) {
 #if USE_LIBUSB
-			int err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, RECV_BUF_LEN, &len, io->timeout);
+			// whole packets, so the transfer ends with the expected data
+			// even if it isn't followed by a short or zero-length packet
+			int err, n = plen - nread, k = io->packet_in;
+			if (k > 0) n = (n + k - 1) / k * k;
+			if (n > RECV_BUF_LEN) n = RECV_BUF_LEN;
+			err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, n, &len, io->timeout);
 			if (err == LIBUSB_ERROR_NO_DEVICE)
 				ERR_EXIT("connection closed\n");
 			else if (err == LIBUSB_ERROR_TIMEOUT) break;
@@ -323,7 +376,13 @@ static int usb_recv(usbio_t *io, int plen) {
 				print_mem(stderr, io->recv_buf, len);
 			}
 			pos = 0;
-			if (!len) break;
+			if (!len) {
+#if USE_LIBUSB
+				// skip zero-length packets
+				if (++zlp < 3) continue;
+#endif
+				break;
+			}
 		}
 		a = io->recv_buf[pos++];
 		io->buf[nread++] = a;
@@ -341,7 +400,7 @@ static void mtk_echo(usbio_t *io, const void *data, int len) {
 	usb_send(io, ptr, len);
 	ret = usb_recv(io, len);
 	if (ret != len || memcmp(io->buf, ptr, len))
-		ERR_EXIT("unexpected echo\n");
+		IO_FAIL(io, "unexpected echo\n");
 }
 
 static void mtk_echo8(usbio_t *io, uint32_t value) {
@@ -369,11 +428,13 @@ static void mtk_recv(usbio_t *io, uint32_t value) {
 
 static uint32_t mtk_status(usbio_t *io) {
 	unsigned status;
-	if (usb_recv(io, 2) != 2)
-		ERR_EXIT("unexpected response\n");
+	if (usb_recv(io, 2) != 2) {
+		IO_FAIL(io, "unexpected response\n");
+		return 0;
+	}
 	status = READ16_BE(io->buf);
 	if (status >= 0x100)
-		ERR_EXIT("unexpected status = %d (0x%04x)\n", status, status);
+		IO_FAIL(io, "unexpected status = %d (0x%04x)\n", status, status);
 	else if (status && io->verbose >= 2)
 		DBG_LOG("status = %d (0x%04x)\n", status, status);
 
@@ -381,23 +442,85 @@ static uint32_t mtk_status(usbio_t *io) {
 }
 
 static uint32_t mtk_recv8(usbio_t *io) {
-	if (usb_recv(io, 1) != 1)
-		ERR_EXIT("unexpected response\n");
+	if (usb_recv(io, 1) != 1) {
+		IO_FAIL(io, "unexpected response\n");
+		return 0;
+	}
 	return io->buf[0];
 }
 
 static uint32_t mtk_recv16(usbio_t *io) {
-	if (usb_recv(io, 2) != 2)
-		ERR_EXIT("unexpected response\n");
+	if (usb_recv(io, 2) != 2) {
+		IO_FAIL(io, "unexpected response\n");
+		return 0;
+	}
 	return READ16_BE(io->buf);
 }
 
 static uint32_t mtk_recv32(usbio_t *io) {
-	if (usb_recv(io, 4) != 4)
-		ERR_EXIT("unexpected response\n");
+	if (usb_recv(io, 4) != 4) {
+		IO_FAIL(io, "unexpected response\n");
+		return 0;
+	}
 	return READ32_BE(io->buf);
 }
 
+static void io_drain(usbio_t *io, int timeout) {
+	int old = io->timeout;
+	io->timeout = timeout;
+	io->recv_pos = io->recv_len = 0;
+	while (usb_recv(io, TEMP_BUF_LEN) > 0);
+	io->timeout = old;
+}
+
+/*
+// Brings the BROM or the payload back to the command loop after a protocol
+// error. Zeros complete any pending arguments (as zero sizes for the BROM
+// commands) and then are echoed back as unknown commands. Both answer
+// GET_BL_VER with one byte, which is used to check the link.
+*/
+static int io_resync(usbio_t *io) {
+	static const uint8_t zeros[0x1100];
+	uint8_t cmd = CMD_GET_BL_VER;
+	int i, ret = -1;
+
+	io->recover++;
+	for (i = 0; i < 3 && ret; i++) {
+		io->stat_resyncs++;
+		io->err = 0;
+		io_drain(io, 50);
+		usb_send(io, zeros, sizeof(zeros));
+		io_drain(io, 100);
+		usb_send(io, &cmd, 1);
+		if (usb_recv(io, 1) != 1) continue;
+		// nothing else is expected
+		if (usb_recv(io, 1)) continue;
+		if (!io->err) ret = 0;
+	}
+	io->err = 0;
+	io->recover--;
+	if (ret) DBG_LOG("resync failed\n");
+	return ret;
+}
+
+static void io_begin(usbio_t *io) {
+	if (!io->recover++) io->err = 0;
+}
+
+// Returns 1 to repeat the operation, -1 if out of retries.
+static int io_end(usbio_t *io, int retry) {
+	if (--io->recover) return 0;
+	if (!io->err) return 0;
+	io->err = 0;
+	io->stat_errors++;
+	if (retry >= io->max_retries) return -1;
+	io->stat_retries++;
+	// backoff 10ms, 20ms, ... 1s
+	usleep((retry < 7 ? 10000 << retry : 1000000));
+	io_resync(io);
+	return 1;
+}
+
 static int mtk_handshake(usbio_t *io) {
 	static const uint8_t handshake[] = { 0xa0, 0x0a, 0x50, 0x05 };
 	int i, ret;
@@ -416,80 +539,97 @@ static int mtk_handshake(usbio_t *io) {
 	return 1;
 }
 
-static unsigned dump_mem(usbio_t *io,
-		uint32_t start, uint32_t len, const char *fn, int cmd) {
-	uint32_t i, n, off, nread, step = 1024;
-	int ret, legacy = cmd == CMD_LEGACY_READ;
-	int align = cmd == CMD_READ32 ? 2 : 1;
-	FILE *fo;
+static uint32_t crc32_tab[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
 
-	if ((len | start) & ((1 << align) - 1))
-		ERR_EXIT("unaligned read\n");
+static void crc32_init(void) {
+	uint32_t i, j, a;
+	for (i = 0; i < 256; crc32_tab[i++] = a)
+		for (a = i, j = 0; j < 8; j++)
+			a = a >> 1 ^ (0xedb88320 & -(a & 1));
+}
 
-	fo = fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(dump) failed\n");
+// Also called by the dump writer and manifest threads.
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t n) {
+	pthread_once(&crc32_once, crc32_init);
+	crc = ~crc;
+	while (n--) crc = crc >> 8 ^ crc32_tab[(crc ^ *p++) & 0xff];
+	return ~crc;
+}
 
-	for (off = start; off < start + len; ) {
-		n = start + len - off;
-		if (n > step) n = step;
+#include "kernels.h"
+#include "sha256.h"
+#include "ring.h"
+#include "manifest.h"
+#include "dumpout.h"
+
+// One read command, the data is big-endian words.
+static uint32_t brom_read_cmd(usbio_t *io,
+		uint32_t off, uint32_t n, int cmd, uint8_t *buf) {
+	int legacy = cmd == CMD_LEGACY_READ;
+	uint32_t nread;
+
+	mtk_echo8(io, cmd);
+	mtk_echo32(io, off);
+	mtk_echo32(io, n >> (cmd == CMD_READ32 ? 2 : 1));
+
+	if (!legacy && mtk_status(io))
+		IO_FAIL(io, "unexpected response\n");
+
+	nread = usb_recv(io, n);
+	if (nread != n)
+		IO_FAIL(io, "unexpected response\n");
+	memcpy(buf, io->buf, nread);
+	if (!legacy && mtk_status(io))
+		IO_FAIL(io, "unexpected response\n");
+	return nread;
+}
 
-		mtk_echo8(io, cmd);
-		mtk_echo32(io, off);
-		mtk_echo32(io, n >> align);
+// Reads from off to end with the BROM, returns the offset reached.
+static uint32_t read_mem_brom(usbio_t *io,
+		uint32_t off, uint32_t end, int cmd, dumpout_t *fo) {
+	uint32_t n, nread, step = chunk.brom_read;
+	int ret = 0, retry;
+	int align = cmd == CMD_READ32 ? 2 : 1;
+	uint8_t buf[TEMP_BUF_LEN];
 
-		if (!legacy) {
-			if (usb_recv(io, 2) != 2 || READ16_BE(io->buf)) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-		}
+	while (off < end) {
+		n = end - off;
+		if (n > step) n = step;
 
-		nread = usb_recv(io, n);
-		if (nread != n) {
+		for (retry = 0;; retry++) {
+			io_begin(io);
+			nread = brom_read_cmd(io, off, n, cmd, buf);
+			if ((ret = io_end(io, retry)) <= 0) break;
+		}
+		if (ret < 0) {
 			DBG_LOG("unexpected response\n");
 			break;
 		}
 
-		if (align == 1)
-			for (i = 0; i < nread; i += 2) {
-				uint32_t a = READ16_BE(io->buf + i);
-				io->buf[i + 0] = a & 0xff;
-				io->buf[i + 1] = a >> 8;
-			}
-		else if (align == 2)
-			for (i = 0; i < nread; i += 4) {
-				uint32_t a = READ32_BE(io->buf + i);
-				io->buf[i + 0] = a & 0xff;
-				io->buf[i + 1] = a >> 8;
-				io->buf[i + 2] = a >> 16;
-				io->buf[i + 3] = a >> 24;
-			}
-
-		if (fwrite(io->buf, 1, nread, fo) != nread) 
-			ERR_EXIT("fwrite(dump) failed\n");
-
-		if (!legacy) {
-			if (usb_recv(io, 2) != 2 || READ16_BE(io->buf)) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-		}
+		kern_swap(buf, nread, 1 << align);
 
+		dumpout_write(fo, buf, nread);
 		off += nread;
-		if (n != nread) break;
 	}
-	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, off - start);
-	fclose(fo);
 	return off;
 }
 
-static void mtk_send_long(usbio_t *io, const uint8_t *buf, size_t size) {
-	uint32_t i, n, step = 1024;
-	for (i = 0; i < size; i += n) {
-		n = size - i;
-		if (n > step) n = step;
-		usb_send(io, buf + i, n);
-	}
+static unsigned dump_mem(usbio_t *io,
+		uint32_t start, uint32_t len, const char *fn, int cmd) {
+	uint32_t off;
+	int align = cmd == CMD_READ32 ? 2 : 1;
+	dumpout_t *fo;
+
+	if ((len | start) & ((1 << align) - 1))
+		ERR_EXIT("unaligned read\n");
+
+	fo = dumpout_open(fn, cmd == CMD_READ32 ? "read32" :
+			cmd == CMD_LEGACY_READ ? "legacy_read" : "read16", start, len);
+	off = read_mem_brom(io, start + fo->pos, start + len, cmd, fo);
+	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, off - start);
+	dumpout_close(fo);
+	return off;
 }
 
 static uint8_t* loadfile(const char *fn, size_t *num) {
@@ -509,10 +649,20 @@ static uint8_t* loadfile(const char *fn, size_t *num) {
 	return buf;
 }
 
-static uint32_t mtk_checksum(const uint8_t *buf, uint32_t size) {
-	uint32_t i, chk = 0;
+// XOR of 16-bit LE words, can be continued from an even offset.
+static uint32_t mtk_checksum(uint32_t chk, const uint8_t *buf, size_t size) {
+	static const union { uint16_t u16; uint8_t u8; } le = { 1 };
+	uint64_t x;
+	size_t i = size & ~(size_t)7;
 
-	for (i = 0; i < (size & -2); i += 2)
+	x = kern_xor64(buf, i);
+	x ^= x >> 32;
+	x ^= x >> 16;
+	x &= 0xffff;
+	if (!le.u8) x = x >> 8 | (x & 0xff) << 8;
+	chk ^= x;
+
+	for (; i + 1 < size; i += 2)
 		chk ^= buf[i] | buf[i + 1] << 8;
 
 	if (size & 1) chk ^= buf[i];
@@ -530,6 +680,13 @@ static uint32_t mtk_read16(usbio_t *io, uint32_t addr) {
 	return val;
 }
 
+static uint32_t mtk_legacy_read16(usbio_t *io, uint32_t addr) {
+	mtk_echo8(io, CMD_LEGACY_READ);
+	mtk_echo32(io, addr);
+	mtk_echo32(io, 1);
+	return mtk_recv16(io);
+}
+
 static uint32_t mtk_read32(usbio_t *io, uint32_t addr) {
 	uint32_t val;
 	mtk_echo8(io, CMD_READ32);
@@ -559,31 +716,26 @@ static void mtk_write32(usbio_t *io, uint32_t addr, uint32_t val) {
 	mtk_status(io);
 }
 
-static void mtk_send_da(usbio_t *io, const char *fn, uint32_t addr, uint32_t sig_len) {
-	uint32_t chk1, chk2;
-	uint8_t *mem; size_t size = 0;
-
-	mem = loadfile(fn, &size);
-	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-	if (size >> 32) ERR_EXIT("file too big\n");
+#include "lz4.h"
+#include "upload.h"
 
-	mtk_echo8(io, CMD_SEND_DA);
-	mtk_echo32(io, addr);
-	mtk_echo32(io, size);
-	mtk_echo32(io, sig_len);
-	mtk_status(io);
-
-	chk2 = mtk_checksum(mem, size);
-	mtk_send_long(io, mem, size);
-	chk1 = mtk_recv16(io);
-	free(mem);
-
-	if (chk1 != chk2)
-		ERR_EXIT("bad checksum (recv 0x%04x, calc 0x%04x)\n", chk1, chk2);
-	mtk_status(io);
+static void mtk_send_da(usbio_t *io, const char *fn, uint32_t addr, uint32_t sig_len) {
+	mtk_upload(io, CMD_SEND_DA, addr, upload_load(fn, 0), &sig_len, 1);
 }
 
+#include "fcache.h"
+#include "ftime.h"
 #include "custom_cmd.h"
+#include "regs.h"
+#include "pipe.h"
+#include "plan.h"
+#include "bench.h"
+#include "chunk.h"
+#include "xip.h"
+#include "layout.h"
+#include "search.h"
+#include "copy.h"
+#include "clock.h"
 
 static uint64_t str_to_size(const char *str) {
 	char *end; int shl = 0; uint64_t n;
@@ -603,8 +755,147 @@ static uint64_t str_to_size(const char *str) {
 	return n << shl;
 }
 
+#include "script.h"
+
 #define REOPEN_FREQ 2
 
+// file: the argument index of an input file
+// load: -1 = only check, or the flags for upload_load()
+static const struct {
+	const char *name;
+	int nargs, file, load;
+} cmd_table[] = {
+	{ "verbose", 1, 0, 0 },
+	{ "bl_ver", 0, 0, 0 },
+	{ "connect", 0, 0, 0 },
+	{ "handshake", 0, 0, 0 },
+	{ "show_flash", 1, 0, 0 },
+	{ "reboot", 0, 0, 0 },
+	{ "jump_bl", 0, 0, 0 },
+	{ "get_meid", 0, 0, 0 },
+	{ "read16", 3, 0, 0 },
+	{ "read32", 3, 0, 0 },
+	{ "legacy_read", 3, 0, 0 },
+	{ "send_da", 3, 1, 0 },
+	{ "simple_da", 2, 1, 0 },
+	{ "send_epp", 4, 1, 0 },
+	{ "auto_da", 1, 1, 0 },
+	{ "skip", 1, 0, 0 },
+	{ "jump_da", 1, 0, 0 },
+	{ "flash_id", 0, 0, 0 },
+	{ "read_mem", 3, 0, 0 },
+	{ "pmic_dump", 3, 0, 0 },
+	{ "i2c_dump", 4, 0, 0 },
+	{ "regs", 1, 1, -1 },
+	{ "write_mem", 2, 2, UPLOAD_UNPACK },
+	{ "sparse", 1, 0, 0 },
+	{ "blockmap", 1, 0, 0 },
+	{ "manifest", 1, 0, 0 },
+	{ "compress", 1, 0, 0 },
+	{ "read_flash", 3, 0, 0 },
+	{ "erase_flash", 2, 0, 0 },
+	{ "write_flash", 4, 4, UPLOAD_UNPACK },
+	{ "run", 1, 1, -1 },
+	{ "flash_cache", 1, 0, 0 },
+	{ "verify", 2, 2, -1 },
+	{ "link_bench", 2, 0, 0 },
+	{ "chunk", 2, 0, 0 },
+	{ "flash_path", 1, 0, 0 },
+	{ "regions", 1, 0, 0 },
+	{ "search", 3, 0, 0 },
+	{ "search_flash", 3, 0, 0 },
+	{ "copy_flash", 3, 0, 0 },
+	{ "fill_flash", 3, 0, 0 },
+	{ "clock", 2, 1, -1 },
+	{ "clock_restore", 0, 0, 0 },
+	{ "flash_stats", 1, 0, 0 },
+	{ NULL, 0, 0, 0 }
+};
+
+#define PREFETCH_MAX (UPLOAD_CACHE / 2)
+
+static struct {
+	const char *fn[PREFETCH_MAX];
+	int flags[PREFETCH_MAX], n;
+} prefetch;
+
+static char** argv_add(char **out, int *n, char **src, int count) {
+	out = (char**)realloc(out, (*n + count) * sizeof(char*));
+	if (!out) ERR_EXIT("malloc failed\n");
+	memcpy(out + *n, src, count * sizeof(char*));
+	*n += count;
+	return out;
+}
+
+#define SCRIPT_DEPTH 8
+
+// Replaces "run <script>" with the commands of the script.
+static char** expand_scripts(int *argc, char **argv, int depth) {
+	int i, n, k = 0, left = *argc, sargc;
+	char **out = argv_add(NULL, &k, argv, 1), **s, **t;
+
+	for (; left > 1; left -= n + 1, argv += n + 1) {
+		for (i = 0; cmd_table[i].name; i++)
+			if (!strcmp(argv[1], cmd_table[i].name)) break;
+		n = cmd_table[i].nargs;
+		// the errors are reported by check_commands
+		if (!cmd_table[i].name || left <= n + 1) {
+			out = argv_add(out, &k, argv + 1, left - 1);
+			break;
+		}
+		if (strcmp(argv[1], "run")) {
+			out = argv_add(out, &k, argv + 1, n + 1);
+			continue;
+		}
+		if (depth >= SCRIPT_DEPTH)
+			ERR_EXIT("run: too many nested scripts\n");
+		s = script_load(argv[2], &sargc);
+		t = expand_scripts(&sargc, s, depth + 1);
+		out = argv_add(out, &k, t + 1, sargc - 1);
+		free(t); free(s);
+	}
+	*argc = k;
+	return out;
+}
+
+// Checks the commands and input files before waiting for the device.
+static void check_commands(int argc, char **argv) {
+	int i, n, k; FILE *f;
+	uint8_t magic[4];
+	for (; argc > 1; argc -= n + 1, argv += n + 1) {
+		for (i = 0; cmd_table[i].name; i++)
+			if (!strcmp(argv[1], cmd_table[i].name)) break;
+		if (!cmd_table[i].name)
+			ERR_EXIT("unknown command \"%s\"\n", argv[1]);
+		n = cmd_table[i].nargs;
+		if (argc <= n + 1)
+			ERR_EXIT("bad command \"%s\"\n", argv[1]);
+		if (!pipe_experimental &&
+				(!strcmp(argv[1], "pmic_dump") || !strcmp(argv[1], "i2c_dump")))
+			ERR_EXIT("%s: the command layout isn't verified (use --experimental)\n", argv[1]);
+		if (!(k = cmd_table[i].file)) continue;
+		if (!(f = fopen(argv[1 + k], "rb")))
+			ERR_EXIT("fopen(\"%s\") failed\n", argv[1 + k]);
+		if (fread(magic, 1, 4, f) != 4) memset(magic, 0, 4);
+		fclose(f);
+		// plans are mapped, not loaded
+		if ((uint32_t)READ32_LE(magic) == PLAN_MAGIC) continue;
+		if (cmd_table[i].load >= 0 && prefetch.n < PREFETCH_MAX) {
+			prefetch.fn[prefetch.n] = argv[1 + k];
+			prefetch.flags[prefetch.n++] = cmd_table[i].load;
+		}
+	}
+}
+
+// Loads the input files while waiting for the device.
+static void* prefetch_main(void *arg) {
+	int i;
+	(void)arg;
+	for (i = 0; i < prefetch.n; i++)
+		upload_load(prefetch.fn[i], prefetch.flags[i]);
+	return NULL;
+}
+
 int main(int argc, char **argv) {
 #if USE_LIBUSB
 	libusb_device_handle *device;
@@ -614,9 +905,12 @@ int main(int argc, char **argv) {
 	usbio_t *io; int ret, i;
 	int wait = 300 * REOPEN_FREQ;
 	const char *tty = "/dev/ttyUSB0";
-	int verbose = 0;
+	int verbose = 0, retries = 5, prepared = 0;
 	uint32_t info[4] = { -1, -1, -1, -1 };
+	char meid[65] = "";
+	pthread_t prefetch_thread;
 
+	kern_init();
 #if USE_LIBUSB
 	ret = libusb_init(NULL);
 	if (ret < 0)
@@ -636,11 +930,38 @@ int main(int argc, char **argv) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			verbose = atoi(argv[2]);
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--retries")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			retries = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--prepare")) {
+			if (argc <= 3) ERR_EXIT("bad option\n");
+			plan_prepare(argv[2], argv[3]);
+			prepared = 1;
+			argc -= 3; argv += 3;
+		} else if (!strcmp(argv[1], "--resume")) {
+			dump_resume = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--caps")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			pl_caps = strtol(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--experimental")) {
+			pipe_experimental = 1;
+			argc -= 1; argv += 1;
 		} else if (argv[1][0] == '-') {
 			ERR_EXIT("unknown option\n");
 		} else break;
 	}
 
+	// nothing else to do
+	if (prepared && argc <= 1) return 0;
+
+	argv = expand_scripts(&argc, argv, 0);
+	check_commands(argc, argv);
+	if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL))
+		ERR_EXIT("pthread_create failed\n");
+
 	for (i = 0; ; i++) {
 #if USE_LIBUSB
 		device = libusb_open_device_with_vid_pid(NULL, 0x0e8d, 0x0003);
@@ -663,6 +984,9 @@ int main(int argc, char **argv) {
 	io = usbio_init(serial, 0);
 #endif
 	io->verbose = verbose;
+	if (io->verbose && io->packet_in)
+		DBG_LOG("usb: max packet size in %d, out %d\n", io->packet_in, io->packet_out);
+	io->max_retries = retries;
 
 	while (argc > 1) {
 		
@@ -684,8 +1008,16 @@ int main(int argc, char **argv) {
 		} else if (!strcmp(argv[1], "connect")) {
 			uint8_t get_ver;
 			uint32_t i, chip;
-
-			mtk_handshake(io);
+			regs_t r;
+
+			// the payload echoes the handshake like the BROM after one,
+			// so it's probed only then, the setup is already done if it's running
+			if (!mtk_handshake(io) && pl_probe(io, 100, info)) {
+				DBG_LOG("payload is running, HW = %04X:%04X, SW = %04X:%04X\n",
+						info[2], info[3], info[0], info[1]);
+				argc -= 1; argv += 1;
+				continue;
+			}
 
 			get_ver = CMD_GET_VERSION;
 			usb_send(io, &get_ver, 1);
@@ -701,20 +1033,21 @@ int main(int argc, char **argv) {
 			if (io->buf[0] != get_ver)
 				DBG_LOG("BOOTLOADER version: 0x%02x\n", io->buf[0]);
 
-			for (i = 0; i < 4; i++) {
-				mtk_echo8(io, CMD_LEGACY_READ);
-				mtk_echo32(io, 0x80000000 + i * 4);
-				mtk_echo32(io, 1);
-				info[i] = mtk_recv16(io);
-			}
+			regs_init(&r);
+			for (i = 0; i < 4; i++)
+				regs_op(&r, REGS_R16, 0x80000000 + i * 4, 0, 0, 0);
+			regs_run(io, &r, info);
 
 			DBG_LOG("HW = %04X:%04X, SW = %04X:%04X\n",
 					info[2], info[3], info[0], info[1]);
 
 			chip = info[2];
 			// disable watchdog
-			if (chip == 0x6260 || chip == 0x6261)
-				mtk_write16(io, 0xa0030000, 0x2200);
+			if (chip == 0x6260 || chip == 0x6261) {
+				regs_init(&r);
+				regs_op(&r, REGS_W16, 0xa0030000, 0x2200, 0, 0);
+				regs_run(io, &r, NULL);
+			}
 
 			argc -= 1; argv += 1;
 
@@ -723,27 +1056,33 @@ int main(int argc, char **argv) {
 			argc -= 1; argv += 1;
 
 		} else if (!strcmp(argv[1], "show_flash")) {
-			uint32_t addr = 0xa0510000, val, val2, state;
+			uint32_t addr = 0xa0510000, state;
 			uint32_t chip = info[2];
+			regs_t r;
 			if (argc <= 2) ERR_EXIT("bad command\n");
 			state = atoi(argv[2]);
 
 			if (chip == 0x6260 || chip == 0x6261) {
-				val = mtk_read32(io, addr);
-				val2 = state ? val | 2 : val & ~2;
-				if (val != val2)
-					mtk_write32(io, addr, val2);
+				regs_init(&r);
+				regs_op(&r, state ? REGS_SET : REGS_CLR, addr, 2, 0, 0);
+				regs_run(io, &r, NULL);
+				flash_mapped = state;
+				fpath_main = 0;
 			}
 			argc -= 2; argv += 2;
 
 		} else if (!strcmp(argv[1], "reboot")) {
 			uint32_t addr = 0xa003001c;
 			uint32_t chip = info[2];
+			regs_t r;
 
+			clock_restore(io);
 			if (chip == 0x6260 || chip == 0x6261) {
-				mtk_write32(io, addr, 0x1209);
+				regs_init(&r);
+				regs_op(&r, REGS_W32, addr, 0x1209, 0, 0);
+				regs_run(io, &r, NULL);
 			}
-			argc -= 2; argv += 2;
+			argc -= 1; argv += 1;
 
 		} else if (!strcmp(argv[1], "jump_bl")) {
 			mtk_echo8(io, CMD_JUMP_BL);
@@ -764,39 +1103,16 @@ int main(int argc, char **argv) {
 			for (i = 0; i < size; i++)
 				DBG_LOG("%02x", io->buf[i]);
 			DBG_LOG("\n");
+			// the key of the flash cache
+			for (i = 0; i < size && i * 2 + 2 < sizeof(meid); i++)
+				sprintf(meid + i * 2, "%02x", io->buf[i]);
 
 			mtk_status(io);
 			argc -= 1; argv += 1;
 
-		} else if (!strcmp(argv[1], "read16")) {
-			const char *fn; uint32_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			fn = argv[4];
-			dump_mem(io, addr, size, fn, CMD_READ16);
-			argc -= 4; argv += 4;
-
-		} else if (!strcmp(argv[1], "read32")) {
-			const char *fn; uint32_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			fn = argv[4];
-			dump_mem(io, addr, size, fn, CMD_READ32);
-			argc -= 4; argv += 4;
-
-		} else if (!strcmp(argv[1], "legacy_read")) {
-			const char *fn; uint32_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			fn = argv[4];
-			dump_mem(io, addr, size, fn, CMD_LEGACY_READ);
-			argc -= 4; argv += 4;
+		} else if (read_kind(argv[1]) >= 0) {
+			int n = read_batch(io, argc, argv);
+			argc -= n; argv += n;
 
 		} else if (!strcmp(argv[1], "send_da")) {
 			const char *fn; uint32_t addr, sig_len;
@@ -811,21 +1127,30 @@ int main(int argc, char **argv) {
 
 		// simple_da <fn> <addr> = send_da <fn> <addr> 0 jump_da <addr>
 		} else if (!strcmp(argv[1], "simple_da")) {
-			const char *fn; uint32_t addr;
+			const char *fn; uint32_t addr, sig_len = 0, info[3];
+			upload_file_t *f; int found;
 			if (argc <= 3) ERR_EXIT("bad command\n");
 			fn = argv[2];
 			addr = str_to_size(argv[3]);
 
-			mtk_send_da(io, fn, addr, 0);
+			f = upload_load(fn, 0);
+			found = pl_find_info(f->mem, f->size, info);
+			if (found && pl_resident && !memcmp(info, pl_info, sizeof(pl_info))) {
+				DBG_LOG("the same payload is running, skipping the upload\n");
+			} else {
+				mtk_upload(io, CMD_SEND_DA, addr, f, &sig_len, 1);
 
-			mtk_echo8(io, CMD_JUMP_DA);
-			mtk_echo32(io, addr);
-			mtk_status(io);
+				mtk_echo8(io, CMD_JUMP_DA);
+				mtk_echo32(io, addr);
+				mtk_status(io);
+				// learn the capabilities of our payload
+				if (found && !pl_probe(io, 500, NULL))
+					ERR_EXIT("payload didn't respond\n");
+			}
 			argc -= 3; argv += 3;
 
 		} else if (!strcmp(argv[1], "send_epp")) {
-			const char *fn; uint32_t addr, addr2, size2, chk1, chk2;
-			uint8_t *mem; size_t size = 0;
+			const char *fn; uint32_t addr, addr2, size2, args[2];
 			if (argc <= 5) ERR_EXIT("bad command\n");
 
 			fn = argv[2];
@@ -833,25 +1158,8 @@ int main(int argc, char **argv) {
 			addr2 = str_to_size(argv[4]);
 			size2 = str_to_size(argv[5]);
 
-			mem = loadfile(fn, &size);
-			if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-			if (size >> 32) ERR_EXIT("file too big\n");
-
-			mtk_echo8(io, CMD_SEND_EPP);
-			mtk_echo32(io, addr);
-			mtk_echo32(io, size);
-			mtk_echo32(io, addr2);
-			mtk_echo32(io, size2);
-			mtk_status(io);
-
-			chk2 = mtk_checksum(mem, size);
-			mtk_send_long(io, mem, size);
-			chk1 = mtk_recv16(io);
-			free(mem);
-
-			if (chk1 != chk2)
-				ERR_EXIT("bad checksum (recv 0x%04x, calc 0x%04x)\n", chk1, chk2);
-			mtk_status(io);
+			args[0] = addr2; args[1] = size2;
+			mtk_upload(io, CMD_SEND_EPP, addr, upload_load(fn, 0), args, 2);
 
 			// ...
 			// mtk_status(io);
@@ -860,20 +1168,18 @@ int main(int argc, char **argv) {
 			argc -= 5; argv += 5;
 
 		} else if (!strcmp(argv[1], "auto_da")) {
-			const char *fn; uint32_t addr, sig_len, chk1, chk2, entry;
-			uint8_t *mem; size_t size = 0;
-			const char *header = "MMM\1\x38\0\0\0FILE_INFO\0\0\0";
+			const char *fn; uint32_t addr, sig_len, entry;
+			uint8_t *mem; size_t size; upload_file_t *f;
 
 			if (argc <= 2) ERR_EXIT("bad command\n");
 			fn = argv[2];
 
-			mem = loadfile(fn, &size);
-			if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-			if (size >> 32) ERR_EXIT("file too big\n");
+			f = upload_load(fn, 0);
+			mem = f->mem; size = f->size;
 
 			entry = READ32_LE(mem + 0x30);
 
-			if (size < 0x38 || memcmp(mem, header, 0x14) ||
+			if (size < GFH_FILE_INFO_LEN || memcmp(mem, GFH_FILE_INFO, 0x14) ||
 					size != (uint32_t)READ32_LE(mem + 0x20) || entry >= size)
 				ERR_EXIT("unexpected header\n");
 			addr = READ32_LE(mem + 0x1c);
@@ -882,20 +1188,7 @@ int main(int argc, char **argv) {
 			DBG_LOG("addr = 0x%08x, size = 0x%x, sig_len = 0x%x, entry = 0x%x\n",
 					addr, (int)size, sig_len, entry);
 
-			mtk_echo8(io, CMD_SEND_DA);
-			mtk_echo32(io, addr);
-			mtk_echo32(io, size);
-			mtk_echo32(io, sig_len);
-			mtk_status(io);
-
-			chk2 = mtk_checksum(mem, size);
-			mtk_send_long(io, mem, size);
-			chk1 = mtk_recv16(io);
-			free(mem);
-
-			if (chk1 != chk2)
-				ERR_EXIT("bad checksum (recv 0x%04x, calc 0x%04x)\n", chk1, chk2);
-			mtk_status(io);
+			mtk_upload(io, CMD_SEND_DA, addr, f, &sig_len, 1);
 
 			if (entry) {
 				mtk_echo8(io, CMD_JUMP_DA);
@@ -920,6 +1213,8 @@ int main(int argc, char **argv) {
 			mtk_echo8(io, CMD_JUMP_DA);
 			mtk_echo32(io, addr);
 			mtk_status(io);
+			// the capabilities, if it's our payload
+			pl_probe(io, 500, NULL);
 			argc -= 2; argv += 2;
 
 		// the commands below are implemented only in the custom payload
@@ -964,16 +1259,14 @@ int main(int argc, char **argv) {
 				uint8_t buf[256];
 				sfi_read_sfdp(io, 0, buf, 256);
 				if (!memcmp(buf, "SFDP", 4)) {
-					unsigned i = buf[12] | buf[13] << 8 | buf[14] << 16;
-					if (i - 0x18 <= sizeof(buf) - 0x20) {
-						uint32_t x = READ32_LE(buf + i + 4);
+					uint64_t a = sfdp_density(buf) >> 10, b = a << 3;
+					unsigned i;
+					if (a) {
 						int u1 = 'K', u2 = u1;
-						if (!(~x & 0x1fff)) {
-							uint32_t b = (x >> 10) + 1, a = b >> 3;
-							if (!(b & 0x3ff)) b >>= 10, u2 = 'M';
-							if (!(a & 0x3ff)) a >>= 10, u1 = 'M';
-							printf("sfi: SFDP density = %u%cB (%u%cbit)\n", a, u1, b, u2);
-						}
+						if (!(b & 0x3ff)) b >>= 10, u2 = 'M';
+						if (!(a & 0x3ff)) a >>= 10, u1 = 'M';
+						printf("sfi: SFDP density = %u%cB (%u%cbit)\n",
+								(unsigned)a, u1, (unsigned)b, u2);
 					}
 					printf("sfi: SFDP data\n");
 					for (i = 0; i < 256; i++)
@@ -982,18 +1275,124 @@ int main(int argc, char **argv) {
 			}
 			argc -= 1; argv += 1;
 
-		} else if (!strcmp(argv[1], "read_flash")) {
-			const char *fn; uint64_t addr, size;
+		} else if (!strcmp(argv[1], "pmic_dump")) {
+			const char *fn; uint32_t addr, size;
 			if (argc <= 4) ERR_EXIT("bad command\n");
 
 			addr = str_to_size(argv[2]);
 			size = str_to_size(argv[3]);
-			if ((addr | size | (addr + size)) >> 32)
-				ERR_EXIT("32-bit limit reached\n");
 			fn = argv[4];
-			dump_flash(io, addr, size, fn);
+			pmic_dump(io, addr, size, fn);
 			argc -= 4; argv += 4;
 
+		} else if (!strcmp(argv[1], "i2c_dump")) {
+			const char *fn; uint32_t dev, reg, count;
+			if (argc <= 5) ERR_EXIT("bad command\n");
+
+			dev = strtol(argv[2], NULL, 0);
+			reg = strtol(argv[3], NULL, 0);
+			count = strtol(argv[4], NULL, 0);
+			fn = argv[5];
+			i2c_dump(io, dev, reg, count, fn);
+			argc -= 5; argv += 5;
+
+		} else if (!strcmp(argv[1], "regs")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			regs_script(io, argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "write_mem")) {
+			const char *fn; uint32_t addr;
+			if (argc <= 3) ERR_EXIT("bad command\n");
+
+			addr = str_to_size(argv[2]);
+			fn = argv[3];
+			write_mem(io, addr, fn);
+			argc -= 3; argv += 3;
+
+		} else if (!strcmp(argv[1], "sparse")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			dump_sparse = atoi(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "blockmap")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			dump_blockmap = atoi(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "search") || !strcmp(argv[1], "search_flash")) {
+			uint32_t addr, size;
+			if (argc <= 4) ERR_EXIT("bad command\n");
+
+			addr = str_to_size(argv[2]);
+			size = str_to_size(argv[3]);
+			if (argv[1][6]) search_flash(io, addr, size, argv[4]);
+			else search_mem(io, addr, size, 0, 0, argv[4]);
+			argc -= 4; argv += 4;
+
+		} else if (!strcmp(argv[1], "clock")) {
+			if (argc <= 3) ERR_EXIT("bad command\n");
+			clock_set(io, argv[2], info[2], argv[3]);
+			argc -= 3; argv += 3;
+
+		} else if (!strcmp(argv[1], "clock_restore")) {
+			clock_restore(io);
+			argc -= 1; argv += 1;
+
+		} else if (!strcmp(argv[1], "flash_stats")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			flash_stats(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "regions")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			dump_regions = atoi(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "manifest")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			dump_manifest = atoi(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "compress")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			pl_compress = atoi(argv[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "flash_cache")) {
+			uint8_t msg[] = { 0x9f };	// Read JEDEC ID
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			if (!meid[0])
+				ERR_EXIT("flash_cache: unknown MEID (use get_meid before loading the payload)\n");
+			sfi_cmd(io, 0, msg, 1, 3);
+			fcache_open(argv[2], meid,
+					io->buf[0] << 16 | io->buf[1] << 8 | io->buf[2]);
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "verify")) {
+			if (argc <= 3) ERR_EXIT("bad command\n");
+			verify_flash(io, str_to_size(argv[2]), argv[3]);
+			argc -= 3; argv += 3;
+
+		} else if (!strcmp(argv[1], "chunk")) {
+			if (argc <= 3) ERR_EXIT("bad command\n");
+			chunk_cmd(io, argv[2], strcmp(argv[3], "auto") ? str_to_size(argv[3]) : 0);
+			argc -= 3; argv += 3;
+
+		} else if (!strcmp(argv[1], "flash_path")) {
+			if (argc <= 2) ERR_EXIT("bad command\n");
+			for (i = 0; i < FPATH_NUM; i++)
+				if (!strcmp(argv[2], fpath_names[i])) break;
+			if (i == FPATH_NUM) ERR_EXIT("flash_path: unknown path\n");
+			fpath_sel = i;
+			fpath_main = 0;
+			argc -= 2; argv += 2;
+
+		} else if (!strcmp(argv[1], "link_bench")) {
+			if (argc <= 3) ERR_EXIT("bad command\n");
+			link_bench(io, str_to_size(argv[2]), atoi(argv[3]));
+			argc -= 3; argv += 3;
+
 		} else if (!strcmp(argv[1], "erase_flash")) {
 			uint64_t addr, size;
 			if (argc <= 3) ERR_EXIT("bad command\n");
@@ -1005,6 +1404,25 @@ int main(int argc, char **argv) {
 			erase_flash(io, addr, size);
 			argc -= 3; argv += 3;
 
+		} else if (!strcmp(argv[1], "copy_flash")) {
+			uint32_t src, dst, size;
+			if (argc <= 4) ERR_EXIT("bad command\n");
+
+			src = str_to_size(argv[2]);
+			dst = str_to_size(argv[3]);
+			size = str_to_size(argv[4]);
+			flash_copy(io, dst, size, src, NULL, 0);
+			argc -= 4; argv += 4;
+
+		} else if (!strcmp(argv[1], "fill_flash")) {
+			uint32_t addr, size;
+			if (argc <= 4) ERR_EXIT("bad command\n");
+
+			addr = str_to_size(argv[2]);
+			size = str_to_size(argv[3]);
+			fill_flash(io, addr, size, argv[4]);
+			argc -= 4; argv += 4;
+
 		} else if (!strcmp(argv[1], "write_flash")) {
 			const char *fn; uint64_t addr, offset, size;
 			if (argc <= 5) ERR_EXIT("bad command\n");
@@ -1015,7 +1433,13 @@ int main(int argc, char **argv) {
 			fn = argv[5];
 			if ((addr | offset | size | (addr + size)) >> 32)
 				ERR_EXIT("32-bit limit reached\n");
-			write_flash(io, fn, offset, size, addr);
+			{
+				plan_t plan;
+				if (plan_open(fn, &plan)) {
+					write_flash_plan(io, &plan, offset, size, addr);
+					plan_close(&plan);
+				} else write_flash(io, fn, offset, size, addr);
+			}
 			argc -= 5; argv += 5;
 
 		} else {
@@ -1023,6 +1447,11 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (io->stat_errors || io->verbose)
+		DBG_LOG("errors: %u, retries: %u, resyncs: %u\n",
+				io->stat_errors, io->stat_retries, io->stat_resyncs);
+	pthread_join(prefetch_thread, NULL);
+	fcache_save();
 	usbio_free(io);
 #if USE_LIBUSB
 	libusb_exit(NULL);
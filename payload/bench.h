@@ -0,0 +1,40 @@
+
+/* link benchmark: the payload is a data source, sink or loopback */
+
+enum {
+	BENCH_SOURCE = 1,
+	BENCH_SINK,
+	BENCH_LOOP
+};
+
+// The blocks are sent without checksums, the sum of the received
+// words is checked by the host.
+// args: mode, block size, count
+// reply: status, then the blocks, then status, sum of the received words
+static void cmd_link_bench(usbio_t *io) {
+	uint32_t args[3 + 1], res[2 + 1];
+	uint8_t *buf = (uint8_t*)flash_buf;
+	uint32_t mode, size, count, i, j, sum = 0;
+
+	res[0] = FLASH_OK;
+	if (recv_packet(io, args, 3 * 4))
+		res[0] = FLASH_BAD_CHECKSUM;
+	mode = args[0]; size = args[1]; count = args[2];
+	if (!res[0] && (!mode || mode > BENCH_LOOP ||
+			!size || size > FLASH_BUF_SIZE || size & 3))
+		res[0] = FLASH_BAD_ARGS;
+	send_packet(io, res, 4);
+	if (res[0]) return;
+
+	if (mode == BENCH_SOURCE)
+		for (i = 0; i < size; i++) buf[i] = i;
+	for (i = 0; i < count; i++) {
+		if (mode != BENCH_SOURCE) {
+			io->recv_buf(buf, size, 0);
+			for (j = 0; j < size; j += 4) sum += *(uint32_t*)(buf + j);
+		}
+		if (mode != BENCH_SINK) io->send_buf(buf, size, 0);
+	}
+	res[1] = sum;
+	send_packet(io, res, 2 * 4);
+}
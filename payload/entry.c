@@ -39,6 +39,19 @@ enum {
 	CMD_SEND_DA            = 0xd7
 };
 
+// custom commands
+enum {
+	CMD_CUSTOM_SFI         = 0x55,
+	CMD_FLASH_WRITE        = 0x56,
+	CMD_READ_BLOCK         = 0x57,
+	CMD_MEM_WRITE          = 0x58,
+	CMD_REGS               = 0x59,
+	CMD_PROBE              = 0x5a,
+	CMD_LINK_BENCH         = 0x5b,
+	CMD_SEARCH             = 0x5c,
+	CMD_FLASH_COPY         = 0x5d
+};
+
 enum {
 	FLAG_32BIT = 1,
 	FLAG_LEGACY = 2,
@@ -118,7 +131,49 @@ static void cmd_jump_da(usbio_t *io) {
 
 #define MEM4(addr) *(volatile uint32_t*)(addr)
 
+// NULL if not found
+static timer_t *brom_timer;
+
 #include "sfi.h"
+#include "lz4.h"
+#include "rle.h"
+#include "crc32.h"
+#include "flash.h"
+#include "regs.h"
+#include "bench.h"
+#include "search.h"
+
+#define PROBE_MAGIC 0x4c50544d // "MTPL"
+#define PROBE_VERSION 7
+
+enum {
+	CAP_FLASH_WRITE = 1,
+	CAP_READ_BLOCK = 2,
+	CAP_MEM_WRITE = 4,
+	CAP_REGS = 8,
+	CAP_READ_HASH = 16,
+	CAP_LINK_BENCH = 32,
+	CAP_SEARCH = 64,
+	CAP_FLASH_COPY = 128,
+	CAP_FLASH_TIME = 256,
+	CAP_ARGS_ACK = 512
+};
+
+// volatile keeps it in the binary, where the host can find it
+static const volatile uint32_t probe_info[3] = {
+	PROBE_MAGIC, PROBE_VERSION,
+	CAP_FLASH_WRITE | CAP_READ_BLOCK | CAP_MEM_WRITE | CAP_REGS |
+	CAP_READ_HASH | CAP_LINK_BENCH | CAP_SEARCH | CAP_FLASH_COPY |
+	CAP_FLASH_TIME | CAP_ARGS_ACK
+};
+
+// reply: magic, version, caps, then the HW/SW info
+static void cmd_probe(usbio_t *io) {
+	uint32_t res[7 + 1], i;
+	for (i = 0; i < 3; i++) res[i] = probe_info[i];
+	for (i = 0; i < 4; i++) res[3 + i] = MEM2(0x80000000 + i * 4);
+	send_packet(io, res, 7 * 4);
+}
 
 static inline uint32_t comm_check(volatile uint32_t *addr) {
 	uint32_t a0 = addr[0], a1 = addr[1];
@@ -138,8 +193,10 @@ static usbio_t *find_usbio(void) {
 	volatile uint32_t *end = addr + 0x10000 / 4;
 	for (; addr < end; addr++) {
 		uint32_t found = comm_check(addr);
-		if (found)
+		if (found) {
+			brom_timer = (timer_t*)addr[0];
 			return (usbio_t*)found;
+		}
 	}
 	return NULL;
 }
@@ -159,6 +216,7 @@ static usbio_t *usbio_from_arg(uint32_t arg4, uint32_t arg5) {
 			if ((*(uint32_t*)(a0 + i) >> 16) != 0xfff0) return NULL;
 		for (i = 0; i < sizeof(usbio_t); i += 4)
 			if ((*(uint32_t*)(a1 + i) >> 16) != 0xfff0) return NULL;
+		brom_timer = (timer_t*)a0;
 		return (usbio_t*)a1;
 	} while (0);
 	return NULL;
@@ -218,9 +276,33 @@ uint32_t entry_main(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3,
 			cmd_send_da(io);
 			break;
 
-		case 0x55: // custom command
+		case CMD_CUSTOM_SFI:
 			cmd_custom_sfi(io);
 			break;
+		case CMD_FLASH_WRITE:
+			cmd_flash_write(io);
+			break;
+		case CMD_READ_BLOCK:
+			cmd_read_block(io);
+			break;
+		case CMD_MEM_WRITE:
+			cmd_mem_write(io);
+			break;
+		case CMD_REGS:
+			cmd_regs(io);
+			break;
+		case CMD_PROBE:
+			cmd_probe(io);
+			break;
+		case CMD_LINK_BENCH:
+			cmd_link_bench(io);
+			break;
+		case CMD_SEARCH:
+			cmd_search(io);
+			break;
+		case CMD_FLASH_COPY:
+			cmd_flash_copy(io);
+			break;
 		}
 	}
 }
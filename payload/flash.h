@@ -0,0 +1,340 @@
+
+/* on-device flash programming, uses sfi_cmd() */
+
+#define FLASH_BUF_SIZE 0x1000
+#define FLASH_STEP 128
+
+static uint32_t flash_buf[FLASH_BUF_SIZE / 4 + 1];
+static uint32_t pack_buf[FLASH_BUF_SIZE / 4 + 1];
+
+static unsigned flash_cmd_addr(uint8_t *msg, unsigned cmd, uint32_t addr, unsigned alen) {
+	msg[0] = cmd;
+	if (alen > 3) msg[1] = addr >> 24;
+	msg[alen - 2] = addr >> 16;
+	msg[alen - 1] = addr >> 8;
+	msg[alen] = addr;
+	return alen + 1;
+}
+
+static unsigned flash_status(void) {
+	uint8_t msg[1] = { 0x05 }; // Read Status Register
+	sfi_cmd(0, msg, msg, 1, 1);
+	return msg[0];
+}
+
+// durations of the last block write in us (0 without the BROM timer)
+enum {
+	TIME_ERASE, TIME_PROG, TIME_PROG_MAX, TIME_PROG_NUM, TIME_WAIT, TIME_NUM
+};
+
+static uint32_t flash_time[TIME_NUM];
+
+static uint32_t timer_now(void) {
+	return brom_timer ? brom_timer->get_timer() : 0;
+}
+
+static uint32_t timer_us(uint32_t start) {
+	return brom_timer ? brom_timer->timer_to_us(brom_timer->get_timer() - start) : 0;
+}
+
+// the longest erase or program, or polls if there's no timer
+#define FLASH_WAIT_US 4000000
+#define FLASH_WAIT_POLLS 4000000
+
+// Waits for (status & mask) == val, returns 1 on timeout
+// (a stuck or write-protected chip).
+static int flash_poll(unsigned mask, unsigned val) {
+	uint32_t t = timer_now(), n = 0;
+	while ((flash_status() & mask) != val)
+		if (brom_timer ? timer_us(t) > FLASH_WAIT_US : ++n > FLASH_WAIT_POLLS)
+			return 1;
+	return 0;
+}
+
+static int flash_write_enable(void) {
+	uint8_t msg[1] = { 0x06 }; // Write Enable
+	sfi_cmd(0, msg, msg, 1, 0);
+	return flash_poll(2, 2);
+}
+
+static int flash_wait(void) {
+	uint32_t t = timer_now();
+	int ret = flash_poll(1, 0);
+	flash_time[TIME_WAIT] += timer_us(t);
+	return ret;
+}
+
+static void flash_read(uint32_t addr, uint8_t *buf, unsigned size) {
+	uint8_t msg[5];
+	unsigned n, k;
+	for (; size; addr += n, buf += n, size -= n) {
+		n = size < FLASH_STEP ? size : FLASH_STEP;
+		if (addr >> 24) k = flash_cmd_addr(msg, 0x13, addr, 4);
+		else k = flash_cmd_addr(msg, 0x03, addr, 3);
+		sfi_cmd(0, msg, buf, k, n);
+	}
+}
+
+// Returns 1 on timeout.
+static int flash_erase(uint32_t addr, unsigned cmd) {
+	uint8_t msg[4];
+	uint32_t t = timer_now();
+	int ret;
+	if (flash_write_enable()) return 1;
+	sfi_cmd(0, msg, msg, flash_cmd_addr(msg, cmd, addr, 3), 0);
+	ret = flash_wait();
+	flash_time[TIME_ERASE] += timer_us(t);
+	return ret;
+}
+
+// Programs only the bytes that differ from the current content,
+// returns 1 on timeout.
+static int flash_program(uint32_t addr, const uint8_t *src, unsigned size, int erased) {
+	uint8_t msg[5 + FLASH_STEP], old[FLASH_STEP];
+	unsigned n, i, k, l;
+	uint32_t t;
+
+	for (; size; addr += n, src += n, size -= n) {
+		n = 256 - (addr & 255);
+		if (n > FLASH_STEP) n = FLASH_STEP;
+		if (n > size) n = size;
+		if (erased) {
+			for (i = 0; i < n && src[i] == 0xff; i++);
+			for (k = n; k > i && src[k - 1] == 0xff; k--);
+		} else {
+			flash_read(addr, old, n);
+			for (i = 0; i < n && src[i] == old[i]; i++);
+			for (k = n; k > i && src[k - 1] == old[k - 1]; k--);
+		}
+		if (k == i) continue;
+		if ((addr + i) >> 24) l = flash_cmd_addr(msg, 0x12, addr + i, 4);
+		else l = flash_cmd_addr(msg, 0x02, addr + i, 3);
+		for (k -= i; k; k--) msg[l++] = src[i++];
+		t = timer_now();
+		if (flash_write_enable()) return 1;
+		sfi_cmd(0, msg, msg, l, 0);
+		if (flash_wait()) return 1;
+		t = timer_us(t);
+		flash_time[TIME_PROG] += t;
+		if (flash_time[TIME_PROG_MAX] < t) flash_time[TIME_PROG_MAX] = t;
+		flash_time[TIME_PROG_NUM]++;
+	}
+	return 0;
+}
+
+// Check if erase is required (0 to 1 bits found).
+static int flash_need_erase(uint32_t addr, const uint8_t *src, unsigned size) {
+	uint8_t old[FLASH_STEP];
+	unsigned n, i;
+	for (; size; addr += n, src += n, size -= n) {
+		n = size < FLASH_STEP ? size : FLASH_STEP;
+		flash_read(addr, old, n);
+		for (i = 0; i < n; i++)
+			if (~old[i] & src[i]) return 1;
+	}
+	return 0;
+}
+
+static int flash_verify(uint32_t addr, const uint8_t *src, unsigned size) {
+	uint8_t old[FLASH_STEP];
+	unsigned n, i;
+	for (; size; addr += n, src += n, size -= n) {
+		n = size < FLASH_STEP ? size : FLASH_STEP;
+		flash_read(addr, old, n);
+		for (i = 0; i < n; i++)
+			if (old[i] != src[i]) return 1;
+	}
+	return 0;
+}
+
+enum {
+	FLASH_OK = 0,
+	FLASH_BAD_CHECKSUM = 1,
+	FLASH_BAD_ARGS = 2,
+	FLASH_BAD_DATA = 3,
+	FLASH_VERIFY_FAILED = 4,
+	FLASH_TIMEOUT = 5
+};
+
+// Writes buf + off to addr (off is the offset in the erase block,
+// buf holds the block), erasing the block only if necessary.
+// Returns the status.
+static uint32_t flash_write_blk(uint32_t addr, uint8_t *buf, uint32_t size,
+		unsigned cmd, uint32_t blk, uint32_t *erased) {
+	uint32_t off = addr & (blk - 1), end = off + size, i;
+
+	*erased = 0;
+	for (i = 0; i < TIME_NUM; i++) flash_time[i] = 0;
+	if (flash_need_erase(addr, buf + off, size)) {
+		addr -= off;
+		// read missing parts
+		flash_read(addr, buf, off);
+		flash_read(addr + end, buf + end, blk - end);
+		if (flash_erase(addr, cmd) || flash_program(addr, buf, blk, 1))
+			return FLASH_TIMEOUT;
+		*erased = 1;
+		off = 0; size = blk;
+	} else {
+		if (flash_program(addr, buf + off, size, 0))
+			return FLASH_TIMEOUT;
+	}
+	if (flash_verify(addr, buf + off, size))
+		return FLASH_VERIFY_FAILED;
+	return FLASH_OK;
+}
+
+// Writes data within one erase block, erasing it only if necessary.
+// args: addr, size, packed size (0 = raw data), erase cmd, erase block
+// the args are acked with a status, the data is sent only if it's zero
+// reply: status, erased, flash_time
+static void cmd_flash_write(usbio_t *io) {
+	uint32_t args[5 + 1], res[2 + TIME_NUM + 1];
+	uint8_t *buf = (uint8_t*)flash_buf, *pack = (uint8_t*)pack_buf;
+	uint32_t addr, size, packed, blk, off, end, i;
+
+	res[0] = FLASH_OK; res[1] = 0;
+	if (recv_packet(io, args, 5 * 4))
+		res[0] = FLASH_BAD_CHECKSUM;
+	addr = args[0]; size = args[1]; packed = args[2]; blk = args[4];
+	off = addr & (blk - 1); end = off + size;
+	if (blk > FLASH_BUF_SIZE || blk & (blk - 1) ||
+			!size || end > blk || packed >= size)
+		res[0] = FLASH_BAD_ARGS;
+	send_packet(io, res, 4);
+	if (res[0]) return;
+
+	do {
+		if (recv_packet(io, pack, packed ? packed : size)) {
+			res[0] = FLASH_BAD_CHECKSUM; break;
+		}
+		if (!packed)
+			for (i = 0; i < size; i++) buf[off + i] = pack[i];
+		else if (lz4_decompress(pack, packed, buf + off, size) != (int)size) {
+			res[0] = FLASH_BAD_DATA; break;
+		}
+		res[0] = flash_write_blk(addr, buf, size, args[3], blk, &res[1]);
+	} while (0);
+	for (i = 0; i < TIME_NUM; i++) res[2 + i] = flash_time[i];
+	send_packet(io, res, (2 + TIME_NUM) * 4);
+}
+
+#define FILL_MAX 64
+
+// Copies flash data or fills with a pattern within one erase block,
+// the source may overlap the block.
+// args: addr, size, erase cmd, erase block, source address
+// (or the offset in the pattern, less than its length),
+// pattern length (0 = copy), crc32 to continue
+// then the pattern, FILL_MAX bytes
+// reply: status, erased, crc32 of the new data, flash_time
+static void cmd_flash_copy(usbio_t *io) {
+	uint32_t args[7 + 1], res[3 + TIME_NUM + 1];
+	uint8_t *buf = (uint8_t*)flash_buf, *pat = (uint8_t*)pack_buf;
+	uint32_t addr, size, blk, src, len, off, i;
+
+	res[0] = FLASH_OK; res[1] = 0; res[2] = 0;
+	do {
+		if (recv_packet(io, args, 7 * 4) | recv_packet(io, pat, FILL_MAX)) {
+			res[0] = FLASH_BAD_CHECKSUM; break;
+		}
+		addr = args[0]; size = args[1]; blk = args[3];
+		src = args[4]; len = args[5];
+		off = addr & (blk - 1);
+		if (blk > FLASH_BUF_SIZE || blk & (blk - 1) ||
+				!size || off + size > blk || len > FILL_MAX || (len && src >= len)) {
+			res[0] = FLASH_BAD_ARGS; break;
+		}
+		if (!len) flash_read(src, buf + off, size);
+		// no division, there's no libgcc
+		else for (i = 0; i < size; i++) {
+			buf[off + i] = pat[src];
+			if (++src == len) src = 0;
+		}
+		res[2] = crc32(args[6], buf + off, size);
+		res[0] = flash_write_blk(addr, buf, size, args[2], blk, &res[1]);
+	} while (0);
+	for (i = 0; i < TIME_NUM; i++) res[3 + i] = flash_time[i];
+	send_packet(io, res, (3 + TIME_NUM) * 4);
+}
+
+enum {
+	READ_FLASH = 1,
+	READ_PACK = 2,
+	READ_HASH = 4
+};
+
+// log2 of the block size, 0 = FLASH_BUF_SIZE
+#define READ_BLK_SHIFT 8
+
+// Sends memory or flash in blocks, each with a header: size, packed size, crc32.
+// READ_HASH: only the headers are sent.
+// args: addr, size, flags
+// reply: status, then the blocks
+static void cmd_read_block(usbio_t *io) {
+	uint32_t args[3 + 1], hdr[3 + 1], res[1 + 1];
+	uint8_t *buf = (uint8_t*)flash_buf, *pack = (uint8_t*)pack_buf;
+	uint32_t addr, size, flags, n, packed, i, blk;
+
+	res[0] = FLASH_OK;
+	if (recv_packet(io, args, 3 * 4))
+		res[0] = FLASH_BAD_CHECKSUM;
+	addr = args[0]; size = args[1]; flags = args[2];
+	blk = flags >> READ_BLK_SHIFT & 31;
+	blk = blk ? 1u << blk : FLASH_BUF_SIZE;
+	if (!(flags & READ_FLASH) && (addr | size) & 3)
+		res[0] = FLASH_BAD_ARGS;
+	if (blk < 4 || blk > FLASH_BUF_SIZE)
+		res[0] = FLASH_BAD_ARGS;
+	send_packet(io, res, 4);
+	if (res[0]) return;
+
+	for (; size; addr += n, size -= n) {
+		n = blk - (addr & (blk - 1));
+		if (n > size) n = size;
+		if (flags & READ_FLASH)
+			flash_read(addr, buf, n);
+		else for (i = 0; i < n; i += 4)
+			*(uint32_t*)(buf + i) = MEM4(addr + i);
+		packed = 0;
+		if ((flags & (READ_PACK | READ_HASH)) == READ_PACK)
+			packed = rle_pack(buf, n, pack, n - 1);
+		hdr[0] = n; hdr[1] = packed;
+		hdr[2] = crc32(0, buf, n);
+		send_packet(io, hdr, 3 * 4);
+		if (flags & READ_HASH) continue;
+		if (packed) send_packet(io, pack, packed);
+		else send_packet(io, buf, n);
+	}
+}
+
+// Writes a block of memory.
+// args: addr, size, packed size (0 = raw data)
+// the args are acked with a status, the data is sent only if it's zero
+// reply: status, crc32 of the written memory
+static void cmd_mem_write(usbio_t *io) {
+	uint32_t args[3 + 1], res[2 + 1];
+	uint8_t *pack = (uint8_t*)pack_buf, *dst;
+	uint32_t size, packed, i;
+
+	res[0] = FLASH_OK; res[1] = 0;
+	if (recv_packet(io, args, 3 * 4))
+		res[0] = FLASH_BAD_CHECKSUM;
+	dst = (uint8_t*)args[0]; size = args[1]; packed = args[2];
+	if (!size || size > FLASH_BUF_SIZE || packed >= size)
+		res[0] = FLASH_BAD_ARGS;
+	send_packet(io, res, 4);
+	if (res[0]) return;
+
+	do {
+		if (recv_packet(io, pack, packed ? packed : size)) {
+			res[0] = FLASH_BAD_CHECKSUM; break;
+		}
+		if (!packed)
+			for (i = 0; i < size; i++) dst[i] = pack[i];
+		else if (lz4_decompress(pack, packed, dst, size) != (int)size) {
+			res[0] = FLASH_BAD_DATA; break;
+		}
+		res[1] = crc32(0, dst, size);
+	} while (0);
+	send_packet(io, res, 2 * 4);
+}
@@ -0,0 +1,33 @@
+
+/* LZ4 block format decoder, returns the decoded size or -1 */
+static int lz4_decompress(const uint8_t *src, unsigned slen, uint8_t *dst, unsigned dlen) {
+	const uint8_t *end = src + slen;
+	uint8_t *d = dst, *dend = dst + dlen;
+	unsigned token, n, a, off;
+	const uint8_t *ref;
+
+	while (src < end) {
+		token = *src++;
+		n = token >> 4;
+		if (n == 15) do {
+			if (src >= end) return -1;
+			n += a = *src++;
+		} while (a == 255);
+		if (n > (unsigned)(end - src) || n > (unsigned)(dend - d)) return -1;
+		while (n--) *d++ = *src++;
+		if (src >= end) break;
+
+		if (end - src < 2) return -1;
+		off = src[0] | src[1] << 8; src += 2;
+		if (!off || off > (unsigned)(d - dst)) return -1;
+		n = (token & 15) + 4;
+		if (n == 15 + 4) do {
+			if (src >= end) return -1;
+			n += a = *src++;
+		} while (a == 255);
+		if (n > (unsigned)(dend - d)) return -1;
+		ref = d - off;
+		while (n--) *d++ = *ref++;
+	}
+	return d - dst;
+}
@@ -0,0 +1,78 @@
+
+/* register micro-ops, a batch is executed in one transfer */
+
+#define MEM2(addr) *(volatile uint16_t*)(addr)
+
+enum {
+	REGS_R32 = 1,   // addr
+	REGS_R16,       // addr
+	REGS_W32,       // addr, val
+	REGS_W16,       // addr, val
+	REGS_SET,       // addr, mask
+	REGS_CLR,       // addr, mask
+	REGS_POLL,      // addr, mask, val, timeout (us)
+	REGS_DELAY,     // us
+	REGS_END
+};
+
+#define REGS_MAX 256
+
+static void regs_delay(uint32_t us) {
+	if (brom_timer) brom_timer->usleep(us);
+}
+
+// args: number of words, acked with a status, then the ops
+// if the status is zero
+// reply: status, ops done, number of results, then the results
+// (reads and polls return the value read)
+static void cmd_regs(usbio_t *io) {
+	static const uint8_t nargs[REGS_END] = { 0, 1, 1, 2, 2, 2, 2, 4, 1 };
+	uint32_t args[1 + 1], hdr[3 + 1];
+	uint32_t *ops = pack_buf, *res = flash_buf;
+	uint32_t n, i, k = 0, op, a, b, t;
+
+	hdr[0] = FLASH_OK; hdr[1] = 0;
+	if (recv_packet(io, args, 4))
+		hdr[0] = FLASH_BAD_CHECKSUM;
+	n = args[0];
+	if (!n || n > REGS_MAX)
+		hdr[0] = FLASH_BAD_ARGS;
+	send_packet(io, hdr, 4);
+	if (hdr[0]) return;
+
+	do {
+		if (recv_packet(io, ops, n * 4)) {
+			hdr[0] = FLASH_BAD_CHECKSUM; break;
+		}
+		for (i = 0; i < n; i += 1 + nargs[op], hdr[1]++) {
+			op = ops[i];
+			if (!op || op >= REGS_END || i + nargs[op] >= n) {
+				hdr[0] = FLASH_BAD_ARGS; break;
+			}
+			a = ops[i + 1]; b = ops[i + 2];
+			switch (op) {
+			case REGS_R32: res[k++] = MEM4(a); break;
+			case REGS_R16: res[k++] = MEM2(a); break;
+			case REGS_W32: MEM4(a) = b; break;
+			case REGS_W16: MEM2(a) = b; break;
+			case REGS_SET: MEM4(a) |= b; break;
+			case REGS_CLR: MEM4(a) &= ~b; break;
+			case REGS_POLL:
+				// without the timer the timeout counts polls
+				for (t = 0; (MEM4(a) & b) != ops[i + 3]; t++) {
+					if (t >= ops[i + 4]) {
+						hdr[0] = FLASH_TIMEOUT; break;
+					}
+					regs_delay(1);
+				}
+				res[k++] = MEM4(a);
+				break;
+			case REGS_DELAY: regs_delay(a); break;
+			}
+			if (hdr[0]) break;
+		}
+	} while (0);
+	hdr[2] = k;
+	send_packet(io, hdr, 3 * 4);
+	if (k) send_packet(io, res, k * 4);
+}
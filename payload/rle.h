@@ -0,0 +1,29 @@
+
+// Run-length coding of constant runs:
+// 0x00-0x7f: 1-128 literal bytes follow
+// 0x80-0xff: the next byte is repeated 3-130 times
+// Returns the packed size, or 0 if it doesn't fit in cap bytes.
+static unsigned rle_pack(const uint8_t *src, unsigned n, uint8_t *dst, unsigned cap) {
+	unsigned i = 0, j = 0, lit = 0, run, m;
+	for (;;) {
+		run = 0;
+		if (i < n) {
+			for (run = 1; i + run < n && run < 130 && src[i + run] == src[i]; run++);
+			if (run < 3) { i += run; continue; }
+		}
+		// flush literals
+		while (lit < i) {
+			m = i - lit;
+			if (m > 128) m = 128;
+			if (j + 1 + m > cap) return 0;
+			dst[j++] = m - 1;
+			while (m--) dst[j++] = src[lit++];
+		}
+		if (!run) break;
+		if (j + 2 > cap) return 0;
+		dst[j++] = 0x80 + run - 3;
+		dst[j++] = src[i];
+		i += run; lit = i;
+	}
+	return j;
+}
@@ -0,0 +1,78 @@
+
+/* pattern search in memory or the flash, only the matches are sent */
+
+#define SEARCH_MAX 64
+#define SEARCH_BATCH 256
+
+// hit must have a spare word for the checksum
+static void search_flush(usbio_t *io, uint32_t *hit, uint32_t n) {
+	uint32_t cnt[1 + 1];
+	cnt[0] = n;
+	send_packet(io, cnt, 4);
+	if (n) send_packet(io, hit, n * 4);
+}
+
+// Compares (data & mask) with the pattern at each offset, a match may
+// end at the end of the range. Stops after max matches (0 = no limit).
+// args: addr, size, flags (READ_FLASH), pattern length, max matches
+// then the pattern and the mask, SEARCH_MAX bytes each
+// reply: status, then packets of match addresses, each preceded
+// by a packet with their number, zero ends the list
+static void cmd_search(usbio_t *io) {
+	uint32_t args[5 + 1], res[1 + 1], hit[SEARCH_BATCH + 1];
+	uint8_t *buf = (uint8_t*)flash_buf, *pat = (uint8_t*)pack_buf, *mask = pat + SEARCH_MAX;
+	uint32_t addr, size, flags, len, max, base, keep = 0, n, i, j, w, nhit = 0;
+
+	res[0] = FLASH_OK;
+	if (recv_packet(io, args, 5 * 4))
+		res[0] = FLASH_BAD_CHECKSUM;
+	if (recv_packet(io, pat, SEARCH_MAX * 2))
+		res[0] = FLASH_BAD_CHECKSUM;
+	addr = args[0]; size = args[1]; flags = args[2];
+	len = args[3]; max = args[4];
+	if (!len || len > SEARCH_MAX)
+		res[0] = FLASH_BAD_ARGS;
+	if (!(flags & READ_FLASH) && (addr | size) & 3)
+		res[0] = FLASH_BAD_ARGS;
+	send_packet(io, res, 4);
+	if (res[0]) return;
+
+	for (i = 0; i < len; i++) pat[i] &= mask[i];
+	for (base = addr; size; ) {
+		n = FLASH_BUF_SIZE - keep;
+		if (n > size) n = size;
+		if (flags & READ_FLASH)
+			flash_read(addr, buf + keep, n);
+		else {
+			// the carried part may leave the buffer unaligned
+			n &= ~3;
+			for (i = 0; i < n; i += 4) {
+				w = MEM4(addr + i);
+				buf[keep + i] = w; buf[keep + i + 1] = w >> 8;
+				buf[keep + i + 2] = w >> 16; buf[keep + i + 3] = w >> 24;
+			}
+		}
+		addr += n; size -= n; n += keep;
+
+		for (i = 0; i + len <= n; i++) {
+			for (j = 0; j < len && (buf[i + j] & mask[j]) == pat[j]; j++);
+			if (j < len) continue;
+			hit[nhit++] = base + i;
+			if (nhit == SEARCH_BATCH) {
+				search_flush(io, hit, nhit);
+				nhit = 0;
+			}
+			if (max && !--max) {
+				size = 0; break;
+			}
+		}
+		// the last len - 1 bytes are checked with the next block
+		if (n < len) i = 0;
+		else i = n - len + 1;
+		keep = n - i;
+		for (j = 0; j < keep; j++) buf[j] = buf[i + j];
+		base += i;
+	}
+	if (nhit) search_flush(io, hit, nhit);
+	search_flush(io, hit, 0);
+}
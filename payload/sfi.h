@@ -42,18 +42,33 @@ static unsigned spd_checksum(const void *src, int len) {
 static void cmd_custom_sfi(usbio_t *io) {
 	uint16_t data[(4 + 256 + 6 + 2) / 2];
 	uint8_t *buf = (uint8_t*)data + 4;
-	unsigned mlen, rlen, mlen2;
+	unsigned mlen, rlen, mlen2, bad;
 
 	io->recv_buf(data, 4, 0);
 	mlen = data[0] & 0x7fff; rlen = data[1];
-	if (mlen + rlen > sizeof(data) - 6) for (;;);
+	// the host will time out and resync
+	if (mlen + rlen > sizeof(data) - 6) return;
 	mlen2 = (mlen + 3) & ~1;
 	io->recv_buf(buf, mlen2, 0);
-	if (spd_checksum(data, 4 + mlen2)) for (;;);
-	if (mlen + rlen)
+	bad = spd_checksum(data, 4 + mlen2);
+	if (mlen + rlen && !bad)
 		sfi_cmd(data[0] >> 15, buf, buf, mlen, rlen);
 	if (rlen & 1) buf[rlen++] = 0;
-	*(uint16_t*)&buf[rlen] = spd_checksum(buf, rlen);
+	// a bad reply checksum makes the host repeat the command
+	*(uint16_t*)&buf[rlen] = spd_checksum(buf, rlen) + !!bad;
 	io->send_buf(buf, rlen + 2, 0);
 }
 
+
+/* checksummed packets, odd lengths are padded */
+static int recv_packet(usbio_t *io, void *buf, unsigned len) {
+	len = (len + 1) & ~1;
+	io->recv_buf(buf, len + 2, 0);
+	return spd_checksum(buf, len + 2);
+}
+
+static void send_packet(usbio_t *io, void *buf, unsigned len) {
+	if (len & 1) ((uint8_t*)buf)[len++] = 0;
+	*(uint16_t*)((uint8_t*)buf + len) = spd_checksum(buf, len);
+	io->send_buf(buf, len + 2, 0);
+}
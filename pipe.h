@@ -0,0 +1,187 @@
+
+/* pipelined BROM commands: the requests are sent together,
+   then the echoes, statuses and values are checked in one go */
+
+#define PIPE_MAX 256
+
+enum { PIPE_ECHO, PIPE_STATUS, PIPE_VALUE };
+
+typedef struct {
+	uint8_t tx[PIPE_MAX], rx[PIPE_MAX], kind[PIPE_MAX];
+	unsigned tx_len, rx_len;
+} pipe_t;
+
+static void pipe_init(pipe_t *p) {
+	p->tx_len = p->rx_len = 0;
+}
+
+static int pipe_fits(pipe_t *p, unsigned tx, unsigned rx) {
+	return p->tx_len + tx <= PIPE_MAX && p->rx_len + rx <= PIPE_MAX;
+}
+
+static void pipe_expect(pipe_t *p, int kind, unsigned val, unsigned n) {
+	if (p->rx_len + n > PIPE_MAX) ERR_EXIT("pipe overflow\n");
+	for (; n--; p->rx_len++) {
+		p->rx[p->rx_len] = val >> n * 8;
+		p->kind[p->rx_len] = kind;
+	}
+}
+
+// n bytes, big-endian
+static void pipe_echo(pipe_t *p, unsigned val, unsigned n) {
+	unsigned i;
+	if (p->tx_len + n > PIPE_MAX) ERR_EXIT("pipe overflow\n");
+	for (i = n; i--;) p->tx[p->tx_len++] = val >> i * 8;
+	pipe_expect(p, PIPE_ECHO, val, n);
+}
+
+static void pipe_status(pipe_t *p) { pipe_expect(p, PIPE_STATUS, 0, 2); }
+// the first byte holds the size
+static void pipe_value(pipe_t *p, unsigned n) {
+	pipe_expect(p, PIPE_VALUE, 0, n);
+	p->rx[p->rx_len - n] = n;
+}
+
+// Returns the number of values stored.
+static unsigned pipe_run(usbio_t *io, pipe_t *p, uint32_t *val) {
+	unsigned i, n, k = 0; uint8_t *buf;
+	int retry, ret;
+
+	if (!p->tx_len) return 0;
+	buf = io->buf;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		usb_send(io, p->tx, p->tx_len);
+		if (usb_recv(io, p->rx_len) != (int)p->rx_len)
+			IO_FAIL(io, "unexpected response\n");
+		for (i = 0; i < p->rx_len && !io->err; i++)
+			if (p->kind[i] == PIPE_ECHO && buf[i] != p->rx[i])
+				IO_FAIL(io, "unexpected echo\n");
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0) ERR_EXIT("too many errors\n");
+
+	for (i = 0; i < p->rx_len; ) {
+		switch (p->kind[i]) {
+		case PIPE_ECHO:
+			i++;
+			break;
+		case PIPE_STATUS:
+			if (buf[i])
+				ERR_EXIT("unexpected status = 0x%04x\n", READ16_BE(buf + i));
+			i += 2;
+			break;
+		default:
+			n = p->rx[i];
+			for (val[k] = 0; n--; i++) val[k] = val[k] << 8 | buf[i];
+			k++;
+		}
+	}
+	pipe_init(p);
+	return k;
+}
+
+// The argument layout of the PWR and I2C commands is reconstructed
+// from the other BROM commands: echoed arguments, status, value, status.
+// It isn't verified on hardware, so the commands need --experimental.
+static int pipe_experimental = 0;
+
+#define PIPE_PWR_READ_TX 3
+#define PIPE_PWR_READ_RX 9
+
+static void pipe_pwr_read16(pipe_t *p, uint32_t addr) {
+	pipe_echo(p, CMD_PWR_READ16, 1);
+	pipe_echo(p, addr, 2);
+	pipe_status(p);
+	pipe_value(p, 2);
+	pipe_status(p);
+}
+
+#define PIPE_I2C_READ_TX 3
+#define PIPE_I2C_READ_RX 7
+
+static void pipe_i2c_read8(pipe_t *p, uint32_t dev, uint32_t reg) {
+	pipe_echo(p, CMD_I2C_READ8, 1);
+	pipe_echo(p, dev, 1);
+	pipe_echo(p, reg, 1);
+	pipe_status(p);
+	pipe_value(p, 1);
+	pipe_status(p);
+}
+
+static void pipe_simple(usbio_t *io, unsigned cmd) {
+	pipe_t p;
+	pipe_init(&p);
+	pipe_echo(&p, cmd, 1);
+	pipe_status(&p);
+	pipe_run(io, &p, NULL);
+}
+
+// Register snapshots, CSV if the file name ends with ".csv",
+// otherwise the values are stored in little-endian order.
+typedef struct {
+	FILE *f;
+	int csv, width;
+} snapshot_t;
+
+static void snapshot_open(snapshot_t *s, const char *fn, int width) {
+	size_t n = strlen(fn);
+	s->csv = n >= 4 && !strcmp(fn + n - 4, ".csv");
+	s->width = width;
+	s->f = fopen(fn, s->csv ? "w" : "wb");
+	if (!s->f) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	if (s->csv) fprintf(s->f, "reg,value\n");
+}
+
+static void snapshot_add(snapshot_t *s, uint32_t reg, uint32_t val) {
+	if (s->csv)
+		fprintf(s->f, "0x%04x,0x%0*x\n", reg, s->width * 2, val);
+	else {
+		uint8_t buf[4] = { val, val >> 8, val >> 16, val >> 24 };
+		if (fwrite(buf, 1, s->width, s->f) != (unsigned)s->width)
+			ERR_EXIT("fwrite failed\n");
+	}
+}
+
+static void pmic_dump(usbio_t *io, uint32_t addr, uint32_t size, const char *fn) {
+	uint32_t val[PIPE_MAX], i, k, n, a;
+	snapshot_t s; pipe_t p;
+
+	if ((addr | size) & 1) ERR_EXIT("unaligned read\n");
+	if (addr > 0x10000 || size > 0x10000 - addr) ERR_EXIT("bad arguments\n");
+	snapshot_open(&s, fn, 2);
+	pipe_simple(io, CMD_PWR_INIT);
+	pipe_init(&p);
+	for (a = addr, i = 0; i < size; i += 2) {
+		pipe_pwr_read16(&p, addr + i);
+		if (i + 2 < size && pipe_fits(&p, PIPE_PWR_READ_TX, PIPE_PWR_READ_RX))
+			continue;
+		n = pipe_run(io, &p, val);
+		for (k = 0; k < n; k++, a += 2) snapshot_add(&s, a, val[k]);
+	}
+	pipe_simple(io, CMD_PWR_DEINIT);
+	fclose(s.f);
+	DBG_LOG("pmic_dump: 0x%04x, size: 0x%x\n", addr, size);
+}
+
+static void i2c_dump(usbio_t *io, uint32_t dev,
+		uint32_t reg, uint32_t count, const char *fn) {
+	uint32_t val[PIPE_MAX], i, k, n, a;
+	snapshot_t s; pipe_t p;
+
+	if (dev > 0xff || reg > 0x100 || count > 0x100 - reg)
+		ERR_EXIT("bad arguments\n");
+	snapshot_open(&s, fn, 1);
+	pipe_simple(io, CMD_I2C_INIT);
+	pipe_init(&p);
+	for (a = reg, i = 0; i < count; i++) {
+		pipe_i2c_read8(&p, dev, reg + i);
+		if (i + 1 < count && pipe_fits(&p, PIPE_I2C_READ_TX, PIPE_I2C_READ_RX))
+			continue;
+		n = pipe_run(io, &p, val);
+		for (k = 0; k < n; k++, a++) snapshot_add(&s, a, val[k]);
+	}
+	pipe_simple(io, CMD_I2C_DEINIT);
+	fclose(s.f);
+	DBG_LOG("i2c_dump: dev 0x%02x, reg 0x%02x, count %u\n", dev, reg, count);
+}
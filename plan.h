@@ -0,0 +1,170 @@
+
+/* write plans: the image is split and compressed once,
+   then the plan file is mapped by each run */
+
+#define PLAN_MAGIC 0x5049544d // "MTIP"
+#define PLAN_VERSION 1
+#define PLAN_HDR 16
+
+// header: magic, version, block size, image size,
+// then the data offsets (one more than blocks), the crc32 of
+// each block and the data (LZ4 if smaller than the block)
+typedef struct {
+	uint8_t *mem;
+	size_t map_size;
+	uint32_t blk, size, nblk;
+	const uint8_t *offs, *crcs;
+} plan_t;
+
+static uint32_t plan_offs(plan_t *p, uint32_t i) {
+	return READ32_LE(p->offs + i * 4);
+}
+
+static void plan_prepare(const char *fn, const char *out) {
+	upload_file_t *f = upload_load(fn, UPLOAD_UNPACK);
+	uint32_t blk = FCACHE_BLK, nblk, i, n, packed, offs;
+	uint32_t count[3] = { 0 };
+	uint8_t pack[FCACHE_BLK], *tab; const uint8_t *src;
+	FILE *fo;
+	int val;
+
+	nblk = (f->size + blk - 1) / blk;
+	tab = (uint8_t*)malloc(PLAN_HDR + nblk * 8 + 4);
+	if (!tab) ERR_EXIT("malloc failed\n");
+	fo = fopen(out, "wb");
+	if (!fo) ERR_EXIT("fopen(\"%s\") failed\n", out);
+	offs = PLAN_HDR + nblk * 8 + 4;
+	if (fseek(fo, offs, SEEK_SET)) ERR_EXIT("fseek failed\n");
+	for (i = 0; i < nblk; i++) {
+		src = f->mem + i * blk;
+		n = f->size - i * blk;
+		if (n > blk) n = blk;
+		count[blk_class(src, n, &val)]++;
+		packed = lz4_compress(src, n, pack, n - 1);
+		if (fwrite(packed ? pack : src, 1, packed ? packed : n, fo) != (packed ? packed : n))
+			ERR_EXIT("fwrite failed\n");
+		WRITE32_LE(tab + PLAN_HDR + i * 4, offs);
+		WRITE32_LE(tab + PLAN_HDR + (nblk + 1 + i) * 4, crc32(0, src, n));
+		offs += packed ? packed : n;
+	}
+	WRITE32_LE(tab + PLAN_HDR + nblk * 4, offs);
+	WRITE32_LE(tab, PLAN_MAGIC);
+	WRITE32_LE(tab + 4, PLAN_VERSION);
+	WRITE32_LE(tab + 8, blk);
+	WRITE32_LE(tab + 12, f->size);
+	if (fseek(fo, 0, SEEK_SET) ||
+			fwrite(tab, 1, PLAN_HDR + nblk * 8 + 4, fo) != PLAN_HDR + nblk * 8 + 4)
+		ERR_EXIT("fwrite failed\n");
+	if (fclose(fo)) ERR_EXIT("fclose failed\n");
+	free(tab);
+	DBG_LOG("prepare: 0x%x bytes, %u blocks (data %u, blank %u, fill %u), plan 0x%x bytes\n",
+			(unsigned)f->size, nblk, count[BLK_DATA], count[BLK_BLANK], count[BLK_FILL], offs);
+}
+
+// Returns 0 if the file is not a plan.
+static int plan_open(const char *fn, plan_t *p) {
+	struct stat st; uint32_t i, a, b, n;
+	int fd = open(fn, O_RDONLY);
+
+	if (fd < 0) ERR_EXIT("open(\"%s\") failed\n", fn);
+	if (fstat(fd, &st)) ERR_EXIT("fstat failed\n");
+	p->map_size = st.st_size;
+	if (p->map_size < PLAN_HDR) { close(fd); return 0; }
+	p->mem = (uint8_t*)mmap(NULL, p->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->mem == MAP_FAILED) ERR_EXIT("mmap(\"%s\") failed\n", fn);
+	if ((uint32_t)READ32_LE(p->mem) != PLAN_MAGIC) {
+		munmap(p->mem, p->map_size);
+		return 0;
+	}
+	p->blk = READ32_LE(p->mem + 8);
+	p->size = READ32_LE(p->mem + 12);
+	if (READ32_LE(p->mem + 4) != PLAN_VERSION || p->blk != FCACHE_BLK)
+		ERR_EXIT("unsupported plan\n");
+	p->nblk = (p->size + (uint64_t)p->blk - 1) / p->blk;
+	p->offs = p->mem + PLAN_HDR;
+	p->crcs = p->offs + (p->nblk + 1) * 4;
+	if (PLAN_HDR + (p->nblk * 2 + 1) * 4ull > p->map_size)
+		ERR_EXIT("bad plan\n");
+	for (i = 0; i < p->nblk; i++) {
+		a = plan_offs(p, i); b = plan_offs(p, i + 1);
+		n = p->size - i * p->blk;
+		if (n > p->blk) n = p->blk;
+		if (b <= a || b - a > n || b > p->map_size)
+			ERR_EXIT("bad plan\n");
+	}
+	return 1;
+}
+
+static void plan_close(plan_t *p) {
+	munmap(p->mem, p->map_size);
+}
+
+// Same as write_flash, but the blocks are sent as they are in the plan.
+static void write_flash_plan(usbio_t *io, plan_t *p,
+		uint32_t src_offs, uint32_t src_size, uint32_t addr) {
+	uint32_t i, n, len, end, crc, old, erased = 0, skipped = 0, size = p->size;
+	uint8_t buf[FCACHE_BLK];
+	const uint8_t *data;
+	journal_t *j;
+	int cache;
+
+	if (size < src_offs)
+		ERR_EXIT("data outside the file\n");
+	size -= src_offs;
+	if (src_size) {
+		if (size < src_size)
+			ERR_EXIT("data outside the file\n");
+		size = src_size;
+	}
+	if ((src_offs | addr) & (p->blk - 1) ||
+			(size & (p->blk - 1) && src_offs + size != p->size))
+		ERR_EXIT("plan: unaligned write\n");
+	if (erase_blk != p->blk)
+		ERR_EXIT("plan: unsupported erase block size\n");
+
+	i = src_offs / p->blk;
+	j = write_journal_open(addr, src_offs, size, p->crcs + i * 4,
+			(size + p->blk - 1) / p->blk * 4);
+	i = !j ? 0 : (j->done < size ? j->done : size) & -p->blk;
+	if (j) j->done = i;
+	end = addr + size;
+	addr += i;
+	i = (src_offs + i) / p->blk;
+
+	cache = 0;
+	if (pl_caps & PL_CAP_FLASH_WRITE)
+		cache = fcache_begin(io, NULL, p->crcs + i * 4, end - addr, addr);
+	else {
+		fcache_drop(addr, end - addr);
+		fcache_save();
+	}
+	flash_raw_bytes = flash_sent_bytes = 0;
+	for (; addr < end; addr += n, i++) {
+		data = p->mem + plan_offs(p, i);
+		len = plan_offs(p, i + 1) - plan_offs(p, i);
+		n = end - addr;
+		if (n > p->blk) n = p->blk;
+		crc = READ32_LE(p->crcs + i * 4);
+		if (cache && n == FCACHE_BLK && fcache_get(addr, &old))
+			skipped++;
+		else if (pl_caps & PL_CAP_FLASH_WRITE) {
+			erased += pl_flash_send(io, addr, data, n, len < n ? len : 0);
+			if (n == FCACHE_BLK) fcache_set(addr, crc);
+		} else {
+			if (len < n) {
+				if (lz4_decompress(data, len, buf, 0, n) != (int)n)
+					ERR_EXIT("bad plan data\n");
+				data = buf;
+			}
+			write_flash_sfi(io, data, n, addr, NULL);
+		}
+		if (j) journal_add(j, n, BLK_DATA, -1);
+	}
+	fcache_save();
+	if (j) journal_close(j, 1);
+	if (io->verbose)
+		DBG_LOG("write_flash: erased %u blocks, skipped %u, sent 0x%llx of 0x%llx bytes\n",
+				erased, skipped, (unsigned long long)flash_sent_bytes,
+				(unsigned long long)flash_raw_bytes);
+}
@@ -0,0 +1,186 @@
+
+/* register micro-ops, run by the payload or one by one with the BROM */
+
+enum {
+	REGS_R32 = 1,   // addr
+	REGS_R16,       // addr
+	REGS_W32,       // addr, val
+	REGS_W16,       // addr, val
+	REGS_SET,       // addr, mask
+	REGS_CLR,       // addr, mask
+	REGS_POLL,      // addr, mask, val, timeout (us)
+	REGS_DELAY,     // us
+	REGS_END
+};
+
+#define REGS_MAX 256
+
+static const uint8_t regs_nargs[REGS_END] = { 0, 1, 1, 2, 2, 2, 2, 4, 1 };
+static const char * const regs_names[REGS_END] = {
+	NULL, "r32", "r16", "w32", "w16", "set", "clr", "poll", "delay" };
+
+typedef struct {
+	uint32_t ops[REGS_MAX];
+	unsigned n, nres;
+} regs_t;
+
+static void regs_init(regs_t *r) {
+	r->n = r->nres = 0;
+}
+
+static int regs_fits(regs_t *r, unsigned op) {
+	return r->n + 1 + regs_nargs[op] <= REGS_MAX;
+}
+
+static void regs_op(regs_t *r, unsigned op,
+		uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+	uint32_t args[4];
+	unsigned i;
+	if (!regs_fits(r, op)) ERR_EXIT("too many register ops\n");
+	args[0] = a; args[1] = b; args[2] = c; args[3] = d;
+	r->ops[r->n++] = op;
+	for (i = 0; i < regs_nargs[op]; i++)
+		r->ops[r->n++] = args[i];
+	if (op == REGS_R32 || op == REGS_R16 || op == REGS_POLL) r->nres++;
+}
+
+static int regs_run_brom(usbio_t *io, regs_t *r, uint32_t *res) {
+	uint32_t *ops = r->ops, i, k = 0, a, b, v, t;
+
+	for (i = 0; i < r->n; i += 1 + regs_nargs[ops[i]]) {
+		a = ops[i + 1]; b = ops[i + 2];
+		switch (ops[i]) {
+		case REGS_R32: res[k++] = mtk_read32(io, a); break;
+		case REGS_R16: res[k++] = mtk_legacy_read16(io, a); break;
+		case REGS_W32: mtk_write32(io, a, b); break;
+		case REGS_W16: mtk_write16(io, a, b); break;
+		case REGS_SET: case REGS_CLR:
+			v = mtk_read32(io, a);
+			b = ops[i] == REGS_SET ? v | b : v & ~b;
+			if (v != b) mtk_write32(io, a, b);
+			break;
+		case REGS_POLL:
+			for (t = 0; ((v = mtk_read32(io, a)) & b) != ops[i + 3]; t += 1000) {
+				if (t >= ops[i + 4]) {
+					res[k++] = v;
+					r->nres = k;
+					return FLASH_TIMEOUT;
+				}
+				usleep(1000);
+			}
+			res[k++] = v;
+			break;
+		case REGS_DELAY: usleep(a); break;
+		}
+	}
+	r->nres = k;
+	return FLASH_OK;
+}
+
+// Returns the status, the results of reads and polls are stored in res,
+// nres is updated to the number of results (less after a poll timeout).
+static int regs_run(usbio_t *io, regs_t *r, uint32_t *res) {
+	uint32_t args[1], hdr[3];
+	int retry, ret;
+
+	if (!r->n) return FLASH_OK;
+	if (!(pl_caps & PL_CAP_REGS))
+		return regs_run_brom(io, r, res);
+
+	args[0] = r->n;
+	for (retry = 0;; retry++) {
+		io_begin(io);
+		mtk_echo8(io, CMD_REGS);
+		pl_send(io, args, sizeof(args));
+		hdr[0] = FLASH_OK; hdr[2] = 0;
+		if (pl_caps & PL_CAP_ARGS_ACK) pl_recv(io, hdr, 4);
+		if (!io->err && !hdr[0]) {
+			pl_send(io, r->ops, r->n * 4);
+			pl_recv(io, hdr, sizeof(hdr));
+		}
+		if (!io->err) {
+			if (hdr[0] == FLASH_BAD_CHECKSUM)
+				IO_FAIL(io, "regs: bad checksum\n");
+			else if (hdr[2] > r->nres)
+				IO_FAIL(io, "unexpected response\n");
+			else if (hdr[2])
+				pl_recv(io, res, hdr[2] * 4);
+		}
+		if ((ret = io_end(io, retry)) <= 0) break;
+	}
+	if (ret < 0) ERR_EXIT("regs: too many errors\n");
+	if (hdr[0] == FLASH_BAD_ARGS) ERR_EXIT("regs: bad ops\n");
+	r->nres = hdr[2];
+	return hdr[0];
+}
+
+static void regs_print(regs_t *r, const uint32_t *res, int status) {
+	uint32_t *ops = r->ops, i, k = 0, op;
+	for (i = 0; i < r->n && k < r->nres; i += 1 + regs_nargs[op]) {
+		op = ops[i];
+		if (op == REGS_R32 || op == REGS_R16 || op == REGS_POLL) {
+			if (op == REGS_POLL && status && k == r->nres - 1)
+				DBG_LOG("poll 0x%08x: timeout, 0x%08x\n", ops[i + 1], res[k]);
+			else
+				DBG_LOG("%s 0x%08x: 0x%0*x\n", regs_names[op], ops[i + 1],
+						op == REGS_R16 ? 4 : 8, res[k]);
+			k++;
+		}
+	}
+}
+
+// Parses a script line: op args..., as in regs_names, "#" starts a comment.
+// Returns the op, or 0 for an empty line.
+static unsigned regs_parse(char *line, uint32_t *args,
+		const char *fn, unsigned line_num) {
+	char *p, *end;
+	unsigned op, i;
+
+	if ((p = strchr(line, '#'))) *p = 0;
+	p = strtok(line, " \t\r\n");
+	if (!p) return 0;
+	for (op = 1; op < REGS_END; op++)
+		if (!strcmp(p, regs_names[op])) break;
+	if (op == REGS_END)
+		ERR_EXIT("%s:%u: unknown op \"%s\"\n", fn, line_num, p);
+	// the poll timeout is optional
+	args[3] = 100000;
+	for (i = 0; (p = strtok(NULL, " \t\r\n")); i++) {
+		if (i >= regs_nargs[op]) break;
+		args[i] = strtoul(p, &end, 0);
+		if (*end) break;
+	}
+	if (p || i + (op == REGS_POLL) < regs_nargs[op])
+		ERR_EXIT("%s:%u: bad arguments\n", fn, line_num);
+	return op;
+}
+
+static void regs_script(usbio_t *io, const char *fn) {
+	regs_t r; uint32_t res[REGS_MAX], args[4];
+	char line[256];
+	unsigned op, n = 0, line_num = 0;
+	FILE *f = fopen(fn, "r");
+	int status;
+
+	if (!f) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	regs_init(&r);
+	for (;;) {
+		op = 0;
+		if (fgets(line, sizeof(line), f) &&
+				!(op = regs_parse(line, args, fn, ++line_num))) continue;
+		if (op && regs_fits(&r, op)) {
+			regs_op(&r, op, args[0], args[1], args[2], args[3]);
+			continue;
+		}
+		// run a full batch, or what's left at the end
+		status = regs_run(io, &r, res);
+		regs_print(&r, res, status);
+		n += r.n;
+		if (status) ERR_EXIT("regs: poll timeout\n");
+		regs_init(&r);
+		if (!op) break;
+		regs_op(&r, op, args[0], args[1], args[2], args[3]);
+	}
+	fclose(f);
+	if (io->verbose) DBG_LOG("regs: %u words\n", n);
+}
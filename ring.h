@@ -0,0 +1,93 @@
+
+/* a bounded ring of blocks processed by a worker thread,
+   the producer waits when the ring is full */
+
+#define RING_BLK 0x1000
+
+typedef void (*ring_fn)(void *ctx, const uint8_t *buf, uint32_t len);
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *mem;
+	uint32_t *len;
+	unsigned n, head, tail, fill;
+	int done;
+	ring_fn fn;
+	void *ctx;
+} ring_t;
+
+static void* ring_main(void *arg) {
+	ring_t *r = (ring_t*)arg;
+	unsigned i;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->tail == r->head && !r->done)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->tail == r->head) break;
+		i = r->tail % r->n;
+		pthread_mutex_unlock(&r->lock);
+
+		r->fn(r->ctx, r->mem + i * RING_BLK, r->len[i]);
+
+		pthread_mutex_lock(&r->lock);
+		r->tail++;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static ring_t* ring_open(unsigned n, ring_fn fn, void *ctx) {
+	ring_t *r = (ring_t*)calloc(1, sizeof(ring_t));
+	if (!r) ERR_EXIT("malloc failed\n");
+	r->mem = (uint8_t*)malloc(n * RING_BLK);
+	r->len = (uint32_t*)malloc(n * sizeof(uint32_t));
+	if (!r->mem || !r->len) ERR_EXIT("malloc failed\n");
+	r->n = n; r->fn = fn; r->ctx = ctx;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, ring_main, r))
+		ERR_EXIT("pthread_create failed\n");
+	return r;
+}
+
+static void ring_push(ring_t *r) {
+	pthread_mutex_lock(&r->lock);
+	r->len[r->head % r->n] = r->fill;
+	r->head++;
+	r->fill = 0;
+	pthread_cond_broadcast(&r->cond);
+	// wait for a free block
+	while (r->head - r->tail >= r->n)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// The data is passed on in full blocks.
+static void ring_write(ring_t *r, const uint8_t *buf, uint32_t len) {
+	uint32_t n;
+	for (; len; buf += n, len -= n) {
+		n = RING_BLK - r->fill;
+		if (n > len) n = len;
+		memcpy(r->mem + (r->head % r->n) * RING_BLK + r->fill, buf, n);
+		r->fill += n;
+		if (r->fill == RING_BLK) ring_push(r);
+	}
+}
+
+// Passes on the last partial block and waits for the worker.
+static void ring_close(ring_t *r) {
+	if (r->fill) ring_push(r);
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->mem); free(r->len);
+	free(r);
+}
@@ -0,0 +1,129 @@
+
+/* command scripts and merged reads */
+
+// Commands as on the command line, "#" starts a comment.
+static char** script_load(const char *fn, int *argc) {
+	char line[1024], *p, **argv;
+	int n = 1;
+	FILE *f = fopen(fn, "r");
+
+	if (!f) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	argv = (char**)malloc(sizeof(char*));
+	if (!argv) ERR_EXIT("malloc failed\n");
+	argv[0] = (char*)fn;
+	while (fgets(line, sizeof(line), f)) {
+		if ((p = strchr(line, '#'))) *p = 0;
+		for (p = strtok(line, " \t\r\n"); p; p = strtok(NULL, " \t\r\n")) {
+			argv = (char**)realloc(argv, (n + 1) * sizeof(char*));
+			if (!argv || !(argv[n++] = strdup(p)))
+				ERR_EXIT("malloc failed\n");
+		}
+	}
+	fclose(f);
+	*argc = n;
+	return argv;
+}
+
+enum { READ_PL_MEM = -1, READ_PL_FLASH = -2 };
+
+static const struct {
+	const char *name;
+	int cmd, align;
+} read_kinds[] = {
+	{ "read16", CMD_READ16, 2 },
+	{ "read32", CMD_READ32, 4 },
+	{ "legacy_read", CMD_LEGACY_READ, 2 },
+	{ "read_mem", READ_PL_MEM, 4 },
+	{ "read_flash", READ_PL_FLASH, 1 },
+	{ NULL, 0, 0 }
+};
+
+static int read_kind(const char *name) {
+	int i;
+	for (i = 0; read_kinds[i].name; i++)
+		if (!strcmp(name, read_kinds[i].name)) return i;
+	return -1;
+}
+
+typedef struct {
+	uint32_t addr, size;
+	const char *fn;
+} read_req_t;
+
+static int read_req_cmp(const void *a, const void *b) {
+	const read_req_t *x = (const read_req_t*)a, *y = (const read_req_t*)b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static uint32_t read_range(usbio_t *io, int cmd,
+		uint32_t off, uint32_t end, dumpout_t *fo) {
+	if (cmd == READ_PL_MEM) return off + pl_read(io, off, end - off, 0, fo);
+	if (cmd == READ_PL_FLASH) return read_flash_used(io, off, end, fo);
+	return read_mem_brom(io, off, end, cmd, fo);
+}
+
+static void read_single(usbio_t *io, int cmd, read_req_t *r) {
+	if (cmd == READ_PL_MEM) dump_mem_pl(io, r->addr, r->size, r->fn);
+	else if (cmd == READ_PL_FLASH) dump_flash(io, r->addr, r->size, r->fn);
+	else dump_mem(io, r->addr, r->size, r->fn, cmd);
+}
+
+// Consecutive reads of the same kind are sorted by address, adjacent
+// and overlapping ones are read with one transfer and split into
+// their files. Returns the number of arguments used.
+static int read_batch(usbio_t *io, int argc, char **argv) {
+	int k = read_kind(argv[1]), cmd = read_kinds[k].cmd;
+	unsigned i, j, n, align = read_kinds[k].align;
+	uint64_t addr, size, end;
+	uint32_t off, done;
+	read_req_t *req;
+	dumpout_t **fan, *fo;
+
+	for (n = 0; argc > (int)n * 4 + 4 && !strcmp(argv[n * 4 + 1], argv[1]); n++);
+	if (!n) ERR_EXIT("bad command\n");
+	req = (read_req_t*)malloc(n * sizeof(read_req_t));
+	if (!req) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < n; i++) {
+		addr = str_to_size(argv[i * 4 + 2]);
+		if (strcmp(argv[i * 4 + 3], "auto")) size = str_to_size(argv[i * 4 + 3]);
+		else if (cmd == READ_PL_FLASH)
+			size = layout_auto(io, addr, argv[i * 4 + 4]);
+		else ERR_EXIT("%s: bad size\n", argv[1]);
+		if ((addr | size | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		if ((addr | size) & (align - 1))
+			ERR_EXIT("unaligned read\n");
+		req[i].addr = addr;
+		req[i].size = size;
+		req[i].fn = argv[i * 4 + 4];
+	}
+	qsort(req, n, sizeof(read_req_t), read_req_cmp);
+
+	for (i = 0; i < n; i = j) {
+		end = (uint64_t)req[i].addr + req[i].size;
+		for (j = i + 1; j < n && req[j].addr <= end; j++)
+			if (end < (uint64_t)req[j].addr + req[j].size)
+				end = (uint64_t)req[j].addr + req[j].size;
+		if (j - i == 1) {
+			read_single(io, cmd, &req[i]);
+			continue;
+		}
+		fan = (dumpout_t**)malloc((j - i) * sizeof(dumpout_t*));
+		if (!fan) ERR_EXIT("malloc failed\n");
+		off = end;
+		for (k = 0; k < (int)(j - i); k++) {
+			read_req_t *r = &req[i + k];
+			fan[k] = dumpout_open(r->fn, argv[1], r->addr, r->size);
+			// the earliest resume point
+			if (off > r->addr + fan[k]->pos) off = r->addr + fan[k]->pos;
+		}
+		fo = dumpout_fan(fan, j - i, off);
+		done = read_range(io, cmd, off, end, fo);
+		DBG_LOG("%s: 0x%08x, target: 0x%x, read: 0x%x, files: %u\n", argv[1],
+				req[i].addr, (uint32_t)(end - req[i].addr), done - req[i].addr, j - i);
+		dumpout_close(fo);
+		free(fan);
+	}
+	free(req);
+	return n * 4;
+}
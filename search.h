@@ -0,0 +1,117 @@
+
+/* pattern search done by the payload, only the match addresses are sent */
+
+#define SEARCH_MAX 64
+#define SEARCH_BATCH 256
+#define SEARCH_CHUNK 0x100000
+// the matches after this aren't listed
+#define SEARCH_LIMIT 1000
+
+static int hex_digit(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+// Hex bytes with "?" for any nibble, "/<hex>" sets the mask bits
+// to compare, or "str:" followed by text. Returns the length.
+static unsigned search_parse(const char *s, uint8_t *pat, uint8_t *mask) {
+	const char *m = NULL;
+	unsigned n = 0, i;
+	int a, b;
+
+	if (!strncmp(s, "str:", 4)) {
+		for (s += 4; *s; n++) {
+			if (n == SEARCH_MAX) ERR_EXIT("search: pattern too long\n");
+			pat[n] = *s++; mask[n] = 0xff;
+		}
+	} else for (; *s && *s != '/'; s += 2, n++) {
+		if (n == SEARCH_MAX) ERR_EXIT("search: pattern too long\n");
+		a = s[0] == '?' ? -2 : hex_digit(s[0]);
+		b = s[1] == '?' ? -2 : hex_digit(s[1]);
+		if (a == -1 || b == -1) ERR_EXIT("search: bad pattern\n");
+		pat[n] = (a < 0 ? 0 : a << 4) | (b < 0 ? 0 : b);
+		mask[n] = (a < 0 ? 0 : 0xf0) | (b < 0 ? 0 : 0x0f);
+	}
+	if (*s == '/') m = s + 1;
+	for (i = 0; m && i < n; i++, m += 2) {
+		if ((a = hex_digit(m[0])) < 0 || (b = hex_digit(m[1])) < 0)
+			ERR_EXIT("search: bad mask\n");
+		mask[i] &= a << 4 | b;
+	}
+	if (!n || (m && *m)) ERR_EXIT("search: bad pattern\n");
+	return n;
+}
+
+// Returns the number of matches stored.
+static uint32_t search_chunk(usbio_t *io, uint32_t addr, uint32_t size,
+		unsigned flags, const uint8_t *pat, unsigned len, uint32_t max, uint32_t *hit) {
+	uint32_t args[5], res, n, k;
+
+	args[0] = addr; args[1] = size; args[2] = flags;
+	args[3] = len; args[4] = max;
+	mtk_echo8(io, CMD_SEARCH);
+	pl_send(io, args, sizeof(args));
+	pl_send(io, pat, SEARCH_MAX * 2);
+	pl_recv(io, &res, sizeof(res));
+	if (io->err) return 0;
+	if (res) ERR_EXIT("search failed (status %u)\n", res);
+	for (n = 0;; n += k) {
+		pl_recv(io, &k, sizeof(k));
+		if (io->err || !k) break;
+		if (k > SEARCH_BATCH || k > max - n) {
+			IO_FAIL(io, "unexpected response\n");
+			break;
+		}
+		pl_recv(io, hit + n, k * 4);
+		if (io->err) break;
+	}
+	return n;
+}
+
+// The range is split into chunks, each one is repeated after an error,
+// the matches starting in the overlap belong to the next chunk.
+// The addresses are printed relative to base.
+static void search_mem(usbio_t *io, uint32_t addr, uint32_t size,
+		unsigned flags, uint32_t base, const char *str) {
+	uint8_t pat[SEARCH_MAX * 2];
+	uint32_t hit[SEARCH_LIMIT], off, n, req, total = 0, found, i, k;
+	unsigned len;
+	int retry, ret;
+
+	if (!(pl_caps & PL_CAP_SEARCH))
+		ERR_EXIT("search: not supported by the payload\n");
+	len = search_parse(str, pat, pat + SEARCH_MAX);
+	if (!(flags & READ_FLASH) && (addr | size) & 3)
+		ERR_EXIT("unaligned search\n");
+
+	for (off = 0; off < size && total < SEARCH_LIMIT; off += n) {
+		n = size - off;
+		if (n > SEARCH_CHUNK) n = SEARCH_CHUNK;
+		req = (n + len + 2) & ~3;
+		if (req > size - off) req = size - off;
+		for (retry = 0;; retry++) {
+			io_begin(io);
+			found = search_chunk(io, addr + off, req, flags,
+					pat, len, SEARCH_LIMIT - total, hit + total);
+			if ((ret = io_end(io, retry)) <= 0) break;
+		}
+		if (ret < 0) ERR_EXIT("search: too many errors\n");
+		for (i = k = 0; i < found; i++)
+			if (hit[total + i] - addr - off < n) hit[total + k++] = hit[total + i];
+		total += k;
+	}
+	for (i = 0; i < total; i++) printf("0x%08x\n", hit[i] - base);
+	DBG_LOG("search: %u matches%s\n", total,
+			total == SEARCH_LIMIT ? " (limit reached)" : "");
+}
+
+// The payload searches the mapped window if it's faster than the flash.
+static void search_flash(usbio_t *io, uint32_t addr, uint32_t size, const char *str) {
+	fpath_select(io, addr);
+	if (FPATH_IS_XIP(fpath_main) && !((addr | size) & 3) &&
+			(uint64_t)addr + size <= XIP_SIZE)
+		search_mem(io, XIP_BASE + addr, size, 0, XIP_BASE, str);
+	else search_mem(io, addr, size, READ_FLASH, 0, str);
+}
@@ -0,0 +1,75 @@
+
+/* SHA-256 (FIPS 180-4) */
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+} sha256_t;
+
+static void sha256_init(sha256_t *s) {
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+}
+
+#define SHA256_ROR(a, n) ((a) >> (n) | (a) << (32 - (n)))
+
+static void sha256_block(sha256_t *s, const uint8_t *p) {
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+	uint32_t w[64], v[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) w[i] = READ32_BE(p + i * 4);
+	for (; i < 64; i++) {
+		t1 = w[i - 2]; t2 = w[i - 15];
+		w[i] = w[i - 16] + w[i - 7] +
+				(SHA256_ROR(t1, 17) ^ SHA256_ROR(t1, 19) ^ t1 >> 10) +
+				(SHA256_ROR(t2, 7) ^ SHA256_ROR(t2, 18) ^ t2 >> 3);
+	}
+	memcpy(v, s->h, sizeof(v));
+	for (i = 0; i < 64; i++) {
+		t1 = v[7] + (SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25)) +
+				((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+		t2 = (SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22)) +
+				((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * 4);
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++) s->h[i] += v[i];
+}
+
+static void sha256_update(sha256_t *s, const uint8_t *p, size_t n) {
+	unsigned k = s->len & 63, a;
+	s->len += n;
+	if (k) {
+		a = 64 - k;
+		if (a > n) a = n;
+		memcpy(s->buf + k, p, a);
+		p += a; n -= a;
+		if (k + a < 64) return;
+		sha256_block(s, s->buf);
+	}
+	for (; n >= 64; p += 64, n -= 64) sha256_block(s, p);
+	memcpy(s->buf, p, n);
+}
+
+static void sha256_final(sha256_t *s, uint8_t *out) {
+	uint64_t len = s->len * 8;
+	uint8_t pad[72] = { 0x80 };
+	unsigned i, n = 64 - ((s->len + 8) & 63);
+	for (i = 0; i < 8; i++) pad[n + i] = len >> (56 - i * 8);
+	sha256_update(s, pad, n + 8);
+	for (i = 0; i < 8; i++) WRITE32_BE(out + i * 4, s->h[i]);
+}
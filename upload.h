@@ -0,0 +1,225 @@
+
+/* file cache and DA upload with overlapped transfers and checksum */
+
+#define UPLOAD_XFERS 4
+#define UPLOAD_CACHE 16
+
+typedef struct {
+	char *fn;
+	uint8_t *mem;
+	size_t size, file_size;
+	time_t mtime;
+	uint32_t chk;
+	int chk_valid, flags, loading;
+} upload_file_t;
+
+// also used by the prefetch thread
+static upload_file_t upload_cache[UPLOAD_CACHE];
+static unsigned upload_cache_next;
+static pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+
+static uint8_t* loadstream(FILE *fi, size_t *num) {
+	size_t n, j = 0, cap = 0; uint8_t *buf = NULL, *p;
+	for (;;) {
+		if (j == cap) {
+			cap = cap * 2 + 0x10000;
+			p = (uint8_t*)realloc(buf, cap);
+			if (!p) { free(buf); return NULL; }
+			buf = p;
+		}
+		n = fread(buf + j, 1, cap - j, fi);
+		if (!n) break;
+		j += n;
+	}
+	if (num) *num = j;
+	return buf;
+}
+
+// Accepts raw images and .lz4, .gz, .zst compressed images.
+static uint8_t* loadfile_unpack(const char *fn, size_t *num) {
+	uint8_t magic[4] = { 0 }, *mem, *ret;
+	const char *tool = NULL;
+	size_t size = 0;
+	FILE *fi = fopen(fn, "rb");
+
+	if (!fi) return NULL;
+	if (fread(magic, 1, 4, fi) != 4) memset(magic, 0, 4);
+	fclose(fi);
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b) tool = "gzip";
+	else if ((uint32_t)READ32_LE(magic) == 0xfd2fb528) tool = "zstd";
+	if (tool) {
+		// the decompressor output is streamed through a pipe
+		char *cmd, *p; const char *s;
+		cmd = p = (char*)malloc(strlen(fn) * 4 + 32);
+		if (!cmd) return NULL;
+		p += sprintf(p, "%s -dc -- '", tool);
+		for (s = fn; *s; s++)
+			if (*s == '\'') p += sprintf(p, "'\\''");
+			else *p++ = *s;
+		strcpy(p, "'");
+#ifdef _WIN32
+		fi = popen(cmd, "rb");
+#else
+		fi = popen(cmd, "r");
+#endif
+		free(cmd);
+		if (!fi) return NULL;
+		ret = loadstream(fi, num);
+		if (pclose(fi)) { free(ret); ret = NULL; }
+		return ret;
+	}
+
+	mem = loadfile(fn, &size);
+	if (mem && size >= 4 && READ32_LE(mem) == LZ4_FRAME_MAGIC) {
+		ret = lz4_decode_frame(mem, size, &size);
+		free(mem);
+		mem = ret;
+	}
+	if (num) *num = size;
+	return mem;
+}
+
+enum { UPLOAD_UNPACK = 1 };
+
+// Files are kept loaded for the session, keyed by name, size and mtime.
+// UPLOAD_UNPACK: decompress and apply the block map (for images).
+static upload_file_t* upload_load(const char *fn, int flags) {
+	struct stat st;
+	upload_file_t *f = NULL;
+	uint8_t *mem; size_t size = 0;
+	unsigned i;
+
+	if (stat(fn, &st))
+		ERR_EXIT("stat(\"%s\") failed\n", fn);
+	pthread_mutex_lock(&upload_lock);
+	for (;;) {
+		for (i = 0; i < UPLOAD_CACHE; i++) {
+			f = &upload_cache[i];
+			if (f->fn && !strcmp(f->fn, fn) && f->flags == flags) break;
+		}
+		// wait if it's being loaded by another thread
+		if (i == UPLOAD_CACHE || !f->loading) break;
+		pthread_cond_wait(&upload_cond, &upload_lock);
+	}
+	if (i < UPLOAD_CACHE && f->file_size == (size_t)st.st_size &&
+			f->mtime == st.st_mtime) {
+		pthread_mutex_unlock(&upload_lock);
+		return f;
+	}
+	if (i == UPLOAD_CACHE)
+		do f = &upload_cache[upload_cache_next++ % UPLOAD_CACHE];
+		while (f->loading);
+	free(f->fn); free(f->mem);
+	f->mem = NULL; f->chk_valid = 0;
+	f->flags = flags; f->loading = 1;
+	f->fn = strdup(fn);
+	if (!f->fn) ERR_EXIT("malloc failed\n");
+	pthread_mutex_unlock(&upload_lock);
+
+	if (flags & UPLOAD_UNPACK) {
+		mem = loadfile_unpack(fn, &size);
+		if (mem) blockmap_apply(fn, mem, size);
+	} else mem = loadfile(fn, &size);
+	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
+	if (size >> 32) ERR_EXIT("file too big\n");
+
+	pthread_mutex_lock(&upload_lock);
+	f->mem = mem; f->size = size;
+	f->file_size = st.st_size;
+	f->mtime = st.st_mtime;
+	if (!(flags & UPLOAD_UNPACK)) {
+		f->chk = mtk_checksum(0, mem, size);
+		f->chk_valid = 1;
+	}
+	f->loading = 0;
+	pthread_cond_broadcast(&upload_cond);
+	pthread_mutex_unlock(&upload_lock);
+	return f;
+}
+
+#if USE_LIBUSB
+static void LIBUSB_CALL upload_done(struct libusb_transfer *t) {
+	*(int*)t->user_data = 1;
+}
+#endif
+
+// Sends the data with several transfers in flight and
+// computes the checksum meanwhile (if requested).
+static uint32_t upload_send(usbio_t *io, const uint8_t *buf, size_t size, int calc) {
+	size_t pos = 0; uint32_t n, chk = 0;
+#if USE_LIBUSB
+	struct libusb_transfer *xfer[UPLOAD_XFERS], *t;
+	int done[UPLOAD_XFERS], i, busy = 0, err;
+
+	for (i = 0; i < UPLOAD_XFERS; i++) {
+		xfer[i] = libusb_alloc_transfer(0);
+		if (!xfer[i]) ERR_EXIT("libusb_alloc_transfer failed\n");
+		done[i] = 1;
+	}
+	for (i = 0; (pos < size && !io->err) || busy; i = (i + 1) % UPLOAD_XFERS) {
+		t = xfer[i];
+		if (!done[i]) {
+			while (!done[i]) {
+				err = libusb_handle_events_completed(NULL, &done[i]);
+				if (err < 0)
+					ERR_EXIT("libusb_handle_events failed : %s\n", libusb_error_name(err));
+			}
+			busy--;
+			if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length)
+				IO_FAIL(io, "usb_send failed (%d / %d)\n", t->actual_length, t->length);
+		}
+		if (pos >= size || io->err) continue;
+		n = size - pos;
+		if (n > chunk.upload) n = chunk.upload;
+		libusb_fill_bulk_transfer(t, io->dev_handle, io->endp_out,
+				(uint8_t*)buf + pos, n, upload_done, &done[i], io->timeout);
+		done[i] = 0;
+		err = libusb_submit_transfer(t);
+		if (err < 0)
+			ERR_EXIT("libusb_submit_transfer failed : %s\n", libusb_error_name(err));
+		busy++;
+		if (calc) chk = mtk_checksum(chk, buf + pos, n);
+		pos += n;
+	}
+	for (i = 0; i < UPLOAD_XFERS; i++) libusb_free_transfer(xfer[i]);
+#else
+	int ret;
+	for (; pos < size && !io->err; pos += n) {
+		n = size - pos;
+		if (n > chunk.upload) n = chunk.upload;
+		ret = write(io->serial, buf + pos, n);
+		if (ret != (int)n)
+			IO_FAIL(io, "usb_send failed (%d / %d)\n", ret, n);
+		if (calc) chk = mtk_checksum(chk, buf + pos, n);
+		tcdrain(io->serial);
+	}
+#endif
+	if (io->verbose)
+		DBG_LOG("upload: 0x%llx bytes\n", (unsigned long long)pos);
+	return chk;
+}
+
+// Common part of SEND_DA and SEND_EPP: addr, size, then the other arguments.
+static void mtk_upload(usbio_t *io, int cmd, uint32_t addr,
+		upload_file_t *f, const uint32_t *args, int nargs) {
+	uint32_t chk1, chk2;
+	int i;
+
+	mtk_echo8(io, cmd);
+	mtk_echo32(io, addr);
+	mtk_echo32(io, f->size);
+	for (i = 0; i < nargs; i++)
+		mtk_echo32(io, args[i]);
+	mtk_status(io);
+
+	chk2 = upload_send(io, f->mem, f->size, !f->chk_valid);
+	if (f->chk_valid) chk2 = f->chk;
+	else { f->chk = chk2; f->chk_valid = 1; }
+	chk1 = mtk_recv16(io);
+
+	if (chk1 != chk2)
+		ERR_EXIT("bad checksum (recv 0x%04x, calc 0x%04x)\n", chk1, chk2);
+	mtk_status(io);
+}
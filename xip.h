@@ -0,0 +1,177 @@
+
+/* flash read paths: the payload reading the flash or the mapped window,
+   BROM reads of the mapped window (show_flash 1) and SFI commands,
+   the fastest path that works is picked by a short probe */
+
+#define XIP_BASE 0
+// reads above the window use the other paths
+#define XIP_SIZE 0x1000000
+#define XIP_PROBE_SIZE 0x4000
+
+// the non-XIP paths go first, they are the reference for the window
+enum {
+	FPATH_AUTO, FPATH_PL_FLASH, FPATH_SFI, FPATH_PL_XIP, FPATH_XIP, FPATH_NUM
+};
+
+static const char * const fpath_names[FPATH_NUM] = {
+	"auto", "pl_flash", "sfi", "pl_xip", "xip"
+};
+
+#define FPATH_IS_XIP(p) ((p) >= FPATH_PL_XIP)
+
+static int flash_mapped = 0;
+// the path selected by the user, the path in use and the path above the window
+static int fpath_sel = FPATH_AUTO, fpath_main, fpath_out;
+
+static int fpath_avail(int path) {
+	int xip = flash_mapped && !flash_written;
+	switch (path) {
+	case FPATH_PL_FLASH: return pl_caps & PL_CAP_READ_BLOCK;
+	case FPATH_SFI: return pl_resident;
+	case FPATH_PL_XIP: return xip && pl_caps & PL_CAP_READ_BLOCK;
+	case FPATH_XIP: return xip;
+	}
+	return 0;
+}
+
+// The offsets are flash addresses, the XIP paths must be word aligned.
+static uint32_t fpath_read(usbio_t *io, int path,
+		uint32_t off, uint32_t end, dumpout_t *fo) {
+	uint32_t n, step = chunk.sfi_read;
+
+	switch (path) {
+	case FPATH_PL_FLASH:
+		return off + pl_read(io, off, end - off, READ_FLASH, fo);
+	case FPATH_PL_XIP:
+		return off + pl_read(io, XIP_BASE + off, end - off, 0, fo);
+	case FPATH_XIP:
+		return read_mem_brom(io, XIP_BASE + off, XIP_BASE + end, CMD_READ32, fo) - XIP_BASE;
+	}
+	for (; off < end; off += n) {
+		n = end - off;
+		if (n > step) n = step;
+		sfi_read(io, off, NULL, n);
+
+		dumpout_write(fo, io->buf, n);
+	}
+	return off;
+}
+
+static void fpath_read_buf(usbio_t *io, int path,
+		uint32_t addr, uint8_t *buf, uint32_t size) {
+	uint64_t recv_bytes = 0;
+	uint32_t off, n;
+	unsigned flags = pl_compress ? READ_PACK : 0;
+
+	switch (path) {
+	case FPATH_PL_FLASH:
+		pl_read_chunk(io, addr, size, flags | READ_FLASH, buf, &recv_bytes);
+		break;
+	case FPATH_PL_XIP:
+		pl_read_chunk(io, XIP_BASE + addr, size, flags, buf, &recv_bytes);
+		break;
+	case FPATH_XIP:
+		for (off = 0; off < size && !io->err; off += n) {
+			n = size - off;
+			if (n > chunk.brom_read) n = chunk.brom_read;
+			brom_read_cmd(io, XIP_BASE + addr + off, n, CMD_READ32, buf + off);
+		}
+		kern_swap(buf, size, 4);
+		break;
+	case FPATH_SFI:
+		sfi_read(io, addr, buf, size);
+		break;
+	}
+}
+
+// Times each available path, the window must read the same data as the flash.
+static void fpath_probe(usbio_t *io, uint32_t addr, double *rate) {
+	static uint8_t ref[XIP_PROBE_SIZE], buf[XIP_PROBE_SIZE];
+	int path, fail, have_ref = 0;
+	double t;
+
+	addr &= ~3;
+	if (addr > XIP_SIZE - XIP_PROBE_SIZE) addr = 0;
+	for (path = 1; path < FPATH_NUM; path++) {
+		rate[path] = -1;
+		if (!fpath_avail(path)) continue;
+		io->recover++;
+		io->err = 0;
+		t = time_now();
+		fpath_read_buf(io, path, addr, buf, XIP_PROBE_SIZE);
+		t = time_now() - t;
+		fail = io->err;
+		io->err = 0;
+		io->recover--;
+		if (fail) {
+			io_resync(io);
+			continue;
+		}
+		if (!have_ref) {
+			memcpy(ref, buf, XIP_PROBE_SIZE);
+			have_ref = !FPATH_IS_XIP(path);
+		} else if (memcmp(ref, buf, XIP_PROBE_SIZE)) {
+			DBG_LOG("read_flash: %s returned different data\n", fpath_names[path]);
+			continue;
+		}
+		rate[path] = XIP_PROBE_SIZE / t / 1e6;
+		if (io->verbose)
+			DBG_LOG("read_flash: %s, %.3f MB/s\n", fpath_names[path], rate[path]);
+	}
+}
+
+static void fpath_select(usbio_t *io, uint32_t addr) {
+	double rate[FPATH_NUM] = { 0 };
+	int path, n = 0;
+
+	if (fpath_main && fpath_avail(fpath_main)) return;
+	fpath_main = fpath_out = 0;
+	if (fpath_sel) {
+		if (!fpath_avail(fpath_sel))
+			ERR_EXIT("read_flash: %s isn't available\n", fpath_names[fpath_sel]);
+		fpath_main = fpath_sel;
+		// not probed, the first available path is used above the window
+		for (path = 1; path < FPATH_PL_XIP; path++)
+			if (fpath_avail(path)) {
+				rate[path] = 1;
+				break;
+			}
+	} else {
+		for (path = 1; path < FPATH_NUM; path++)
+			if (fpath_avail(path)) rate[path] = 1, n++;
+		// nothing to compare
+		if (n > 1) fpath_probe(io, addr, rate);
+		for (path = 1; path < FPATH_NUM; path++)
+			if (rate[path] > 0 && (!fpath_main || rate[path] > rate[fpath_main]))
+				fpath_main = path;
+		if (!fpath_main) ERR_EXIT("read_flash: no working path\n");
+	}
+	if (!FPATH_IS_XIP(fpath_main)) fpath_out = fpath_main;
+	else for (path = 1; path < FPATH_PL_XIP; path++)
+		if (rate[path] > 0 && (!fpath_out || rate[path] > rate[fpath_out]))
+			fpath_out = path;
+	if (io->verbose)
+		DBG_LOG("read_flash: using %s, %s above the window\n", fpath_names[fpath_main],
+				fpath_out ? fpath_names[fpath_out] : "nothing");
+}
+
+// Reads the flash from off to end, returns the offset reached.
+static uint32_t read_flash_range(usbio_t *io,
+		uint32_t off, uint32_t end, dumpout_t *fo) {
+	uint32_t n;
+
+	fpath_select(io, off);
+	if (FPATH_IS_XIP(fpath_main) && !(off & 3) && off < XIP_SIZE) {
+		n = end < XIP_SIZE ? end & ~3 : XIP_SIZE;
+		if (n > off) {
+			off = fpath_read(io, fpath_main, off, n, fo);
+			if (off < n) return off;
+		}
+	}
+	if (off < end) {
+		if (!fpath_out)
+			ERR_EXIT("read_flash: 0x%08x is outside the mapped window\n", off);
+		off = fpath_read(io, fpath_out, off, end, fo);
+	}
+	return off;
+}